@@ -0,0 +1,96 @@
+// fuzzes one parser, FUZZ_PARSER and FUZZ_HEADER are set by CMakeLists.txt
+// FUZZ_STRICT passes true to the parser, FUZZ_CHECK is run on what it found, like --strict-gif and --deep-png do
+// linked with libFuzzer it is a libFuzzer target, else it runs each file given to it (or stdin) once, for AFL and the corpus
+#include FUZZ_HEADER
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+namespace {
+    // a parser may look at each byte a few times, an input costing more than this is a failure
+    constexpr uint64_t COST_PER_BYTE = 64;
+    constexpr uint64_t COST_BASE = 4096;
+    // the second run feeds the input in this many pieces, so headers split over buffers are fuzzed too
+    constexpr size_t PIECES = 16;
+
+    void run(std::span<const uint8_t> data, size_t piece) {
+        if (!FUZZ_PARSER::starts(data)) {
+            return;
+        }
+#ifdef FUZZ_STRICT
+        FUZZ_PARSER parser(true);
+#else
+        FUZZ_PARSER parser;
+#endif
+        fuzz_counted = {};
+        uint64_t fed = 0;
+        PARSE result = PARSE_MORE;
+        for (auto rest = data; result == PARSE_MORE && !rest.empty(); ) {
+            const auto part = rest.first(std::min(piece, rest.size()));
+            rest = rest.subspan(part.size());
+            fed += part.size();
+            result = parser.feed(part);
+        }
+#ifdef FUZZ_CHECK
+        if (result == PARSE_DONE && parser.size() <= fed) {
+            FUZZ_CHECK(data.first(parser.size()));
+        }
+#endif
+        const auto bound = COST_BASE + COST_PER_BYTE * data.size();
+        if (fuzz_counted.bytes > bound || fuzz_counted.steps > bound) {
+            fprintf(stderr, "%zu bytes in pieces of %zu: %lu bytes touched, %lu steps, more than %lu\n", data.size(), piece, fuzz_counted.bytes, fuzz_counted.steps, bound);
+            abort();
+        }
+        if (result == PARSE_DONE && parser.size() > fed) {
+            fprintf(stderr, "%zu bytes in pieces of %zu: done after %lu bytes with a size of %lu\n", data.size(), piece, fed, parser.size());
+            abort();
+        }
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    const std::span<const uint8_t> input(data, size);
+    run(input, size);
+    run(input, std::max<size_t>(1, size / PIECES));
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+namespace {
+    void run_file(const std::filesystem::path& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            fprintf(stderr, "can't open %s\n", path.c_str());
+            exit(-1);
+        }
+        const std::vector<uint8_t> data(std::istreambuf_iterator<char>(file), {});
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+}
+
+// a directory runs every file in it, like the corpus
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        const std::vector<uint8_t> data(std::istreambuf_iterator<char>(std::cin), {});
+        return LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    for (int i = 1; i < argc; ++i) {
+        const std::filesystem::path path(argv[i]);
+        if (!std::filesystem::is_directory(path)) {
+            run_file(path);
+            continue;
+        }
+        for (const auto& entry : std::filesystem::directory_iterator(path)) {
+            if (entry.is_regular_file()) {
+                run_file(entry.path());
+            }
+        }
+    }
+    return 0;
+}
+#endif
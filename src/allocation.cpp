@@ -0,0 +1,523 @@
+#include "allocation.h"
+#include "report.h"
+#include "utils.h"
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <stdio.h>
+#include <string>
+
+namespace {
+    constexpr uint64_t SECTOR = 512;
+    // a bitmap larger than this is not an allocation map we can trust
+    constexpr uint64_t MAX_BITMAP = 1024 * 1024 * 1024;
+
+    template<typename T> T le(std::span<const uint8_t> data, size_t offset) {
+        return peek<T, std::endian::little>(data, offset);
+    }
+
+    // empty on a failed or short read
+    std::vector<uint8_t> load(const input& disk, uint64_t offset, uint64_t length) {
+        if (length > MAX_BITMAP || offset > disk.size() || length > disk.size() - offset) {
+            return {};
+        }
+        std::vector<uint8_t> buffer(length);
+        if (!disk.read(offset, buffer.data(), buffer.size())) {
+            return {};
+        }
+        return buffer;
+    }
+
+    struct partition {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    // collects free clusters, neighbours are merged
+    class free_list {
+    public:
+        free_list(const char* name, uint32_t cluster) : name(name), cluster(cluster) {}
+
+        void add(uint64_t offset, uint64_t clusters) {
+            const auto length = clusters * cluster;
+            if (!ranges.empty() && ranges.back().end() == offset) {
+                ranges.back().length += length;
+            } else {
+                ranges.push_back({ offset, length, cluster });
+            }
+        }
+
+        // bit i clear means cluster i at base is free
+        void add_bitmap(std::span<const uint8_t> bitmap, uint64_t bits, uint64_t base) {
+            bits = std::min<uint64_t>(bits, bitmap.size() * 8);
+            uint64_t i = 0;
+            while (i < bits) {
+                if (bitmap[i / 8] == 0xFF && i % 8 == 0) {
+                    i += 8;
+                    continue;
+                }
+                if (bitmap[i / 8] & (1 << (i % 8))) {
+                    ++i;
+                    continue;
+                }
+                const auto first = i;
+                while (i < bits && !(bitmap[i / 8] & (1 << (i % 8)))) {
+                    ++i;
+                }
+                add(base + first * cluster, i - first);
+            }
+        }
+
+        const char* name;
+        uint32_t cluster;
+        std::vector<range> ranges;
+    };
+
+    // https://www.kernel.org/doc/html/latest/filesystems/ext4/globals.html
+    std::optional<free_list> read_ext(const input& disk, const partition& p) {
+        const auto sb = load(disk, p.offset + 1024, 1024);
+        if (sb.empty() || le<uint16_t>(sb, 56) != 0xEF53) {
+            return {};
+        }
+        const auto first_data_block = le<uint32_t>(sb, 20);
+        const auto log_block_size = le<uint32_t>(sb, 24);
+        const auto blocks_per_group = le<uint32_t>(sb, 32);
+        const auto incompat = le<uint32_t>(sb, 96);
+        const bool is_64bit = incompat & 0x80;
+        if (log_block_size > 6 || blocks_per_group == 0) {
+            return {};
+        }
+        const uint32_t block = 1024 << log_block_size;
+        if (blocks_per_group > block * 8) {
+            return {};
+        }
+        uint64_t blocks = le<uint32_t>(sb, 4);
+        size_t desc_size = 32;
+        if (is_64bit) {
+            blocks |= uint64_t(le<uint32_t>(sb, 0x150)) << 32;
+            desc_size = std::max<size_t>(32, le<uint16_t>(sb, 0xFE));
+        }
+        if (blocks <= first_data_block || blocks * block > p.length) {
+            return {};
+        }
+        const auto groups = (blocks - first_data_block + blocks_per_group - 1) / blocks_per_group;
+        const auto descriptors = load(disk, p.offset + uint64_t(first_data_block + 1) * block, groups * desc_size);
+        if (descriptors.empty()) {
+            return {};
+        }
+
+        free_list list("ext", block);
+        for (uint64_t g = 0; g < groups; ++g) {
+            const auto desc = std::span<const uint8_t>(descriptors).subspan(g * desc_size, desc_size);
+            const auto first = first_data_block + g * blocks_per_group;
+            const auto count = std::min<uint64_t>(blocks_per_group, blocks - first);
+            const auto flags = le<uint16_t>(desc, 0x12);
+            if (flags & 0x2) {
+                // BLOCK_UNINIT, the bitmap was never written, only the group metadata is in use
+                list.add(p.offset + first * block, count);
+                continue;
+            }
+            uint64_t bitmap_block = le<uint32_t>(desc, 0);
+            if (is_64bit && desc_size >= 64) {
+                bitmap_block |= uint64_t(le<uint32_t>(desc, 0x20)) << 32;
+            }
+            const auto bitmap = load(disk, p.offset + bitmap_block * block, block);
+            if (bitmap.empty()) {
+                return {};
+            }
+            list.add_bitmap(bitmap, count, p.offset + first * block);
+        }
+        return list;
+    }
+
+    // https://flatcap.github.io/linux-ntfs/ntfs/
+    std::optional<free_list> read_ntfs(const input& disk, const partition& p) {
+        const auto boot = load(disk, p.offset, SECTOR);
+        if (boot.empty() || std::memcmp(boot.data() + 3, "NTFS    ", 8) != 0) {
+            return {};
+        }
+        const uint32_t bytes_per_sector = le<uint16_t>(boot, 11);
+        const auto sectors_per_cluster_raw = le<uint8_t>(boot, 13);
+        const uint32_t sectors_per_cluster = sectors_per_cluster_raw > 0x80 ? 1u << (256 - sectors_per_cluster_raw) : sectors_per_cluster_raw;
+        const auto total_sectors = le<uint64_t>(boot, 40);
+        const auto mft_cluster = le<uint64_t>(boot, 48);
+        const auto clusters_per_record = le<int8_t>(boot, 64);
+        if (!std::has_single_bit(bytes_per_sector) || bytes_per_sector < 256 || !std::has_single_bit(sectors_per_cluster)) {
+            return {};
+        }
+        const uint64_t cluster = uint64_t(bytes_per_sector) * sectors_per_cluster;
+        if (cluster > 2 * 1024 * 1024 || total_sectors * bytes_per_sector > p.length) {
+            return {};
+        }
+        const uint64_t record_size = clusters_per_record > 0 ? clusters_per_record * cluster : uint64_t(1) << -clusters_per_record;
+        if (record_size < bytes_per_sector || record_size > 64 * 1024) {
+            return {};
+        }
+
+        // record 6 is $Bitmap, the first records of the MFT are never fragmented
+        auto record = load(disk, p.offset + mft_cluster * cluster + 6 * record_size, record_size);
+        if (record.empty() || std::memcmp(record.data(), "FILE", 4) != 0) {
+            return {};
+        }
+        // update sequence, the last two bytes of every sector were swapped out
+        const size_t usa_offset = le<uint16_t>(record, 4);
+        const size_t usa_count = le<uint16_t>(record, 6);
+        if (usa_count == 0 || usa_offset + 2 * usa_count > record.size() || (usa_count - 1) * bytes_per_sector > record.size()) {
+            return {};
+        }
+        for (uint32_t i = 1; i < usa_count; ++i) {
+            auto end = record.data() + i * bytes_per_sector - 2;
+            if (std::memcmp(end, record.data() + usa_offset, 2) != 0) {
+                return {};
+            }
+            std::memcpy(end, record.data() + usa_offset + 2 * i, 2);
+        }
+
+        std::vector<uint8_t> bitmap;
+        size_t offset = le<uint16_t>(record, 20);
+        while (offset + 16 <= record.size()) {
+            const auto attr = std::span<const uint8_t>(record).subspan(offset);
+            const auto type = le<uint32_t>(attr, 0);
+            const auto length = le<uint32_t>(attr, 4);
+            if (type == 0xFFFFFFFF || length < 16 || length > attr.size()) {
+                break;
+            }
+            offset += length;
+            if (type != 0x80 || attr[9] != 0) {
+                // not the unnamed $DATA
+                continue;
+            }
+            if (attr[8] == 0) {
+                // resident
+                const auto content = subspan(attr, le<uint16_t>(attr, 20), le<uint32_t>(attr, 16));
+                bitmap.assign(content.begin(), content.end());
+                break;
+            }
+            const auto size = le<uint64_t>(attr, 48);
+            if (size > MAX_BITMAP) {
+                return {};
+            }
+            // data runs, https://flatcap.github.io/linux-ntfs/ntfs/concepts/data_runs.html
+            auto runs = subspan(attr, le<uint16_t>(attr, 32), length);
+            int64_t lcn = 0;
+            while (!runs.empty() && runs[0] != 0 && bitmap.size() < size) {
+                const auto length_bytes = runs[0] & 0xF;
+                const auto offset_bytes = runs[0] >> 4;
+                if (runs.size() < 1u + length_bytes + offset_bytes || length_bytes > 8 || offset_bytes > 8) {
+                    return {};
+                }
+                uint64_t count = 0;
+                for (int i = 0; i < length_bytes; ++i) {
+                    count |= uint64_t(runs[1 + i]) << (8 * i);
+                }
+                int64_t delta = 0;
+                for (int i = 0; i < offset_bytes; ++i) {
+                    delta |= int64_t(runs[1 + length_bytes + i]) << (8 * i);
+                }
+                if (offset_bytes && offset_bytes < 8 && (runs[length_bytes + offset_bytes] & 0x80)) {
+                    // sign extend
+                    delta -= int64_t(1) << (8 * offset_bytes);
+                }
+                runs = runs.subspan(1 + length_bytes + offset_bytes);
+                const auto want = std::min<uint64_t>(count * cluster, size - bitmap.size());
+                if (offset_bytes == 0) {
+                    // sparse
+                    bitmap.resize(bitmap.size() + want);
+                    continue;
+                }
+                lcn += delta;
+                const auto part = load(disk, p.offset + lcn * cluster, want);
+                if (part.empty()) {
+                    return {};
+                }
+                bitmap.insert(bitmap.end(), part.begin(), part.end());
+            }
+            break;
+        }
+        if (bitmap.empty()) {
+            return {};
+        }
+
+        free_list list("ntfs", cluster);
+        list.add_bitmap(bitmap, total_sectors / sectors_per_cluster, p.offset);
+        return list;
+    }
+
+    // https://learn.microsoft.com/en-us/windows/win32/fileio/exfat-specification
+    std::optional<free_list> read_exfat(const input& disk, const partition& p) {
+        const auto boot = load(disk, p.offset, SECTOR);
+        if (boot.empty() || std::memcmp(boot.data() + 3, "EXFAT   ", 8) != 0) {
+            return {};
+        }
+        const auto fat_offset = le<uint32_t>(boot, 80);
+        const auto heap_offset = le<uint32_t>(boot, 88);
+        const auto cluster_count = le<uint32_t>(boot, 92);
+        const auto root = le<uint32_t>(boot, 96);
+        const auto sector_shift = le<uint8_t>(boot, 108);
+        const auto cluster_shift = le<uint8_t>(boot, 109);
+        if (sector_shift < 9 || sector_shift > 12 || sector_shift + cluster_shift > 25) {
+            return {};
+        }
+        const uint64_t sector = uint64_t(1) << sector_shift;
+        const uint64_t cluster = sector << cluster_shift;
+        const uint64_t heap = p.offset + heap_offset * sector;
+        if (heap_offset * sector + cluster_count * cluster > p.length) {
+            return {};
+        }
+        const auto fat = load(disk, p.offset + fat_offset * sector, (uint64_t(cluster_count) + 2) * 4);
+        if (fat.empty()) {
+            return {};
+        }
+        // reads a cluster chain, contiguous if it has no FAT chain
+        auto read_chain = [&](uint32_t first, uint64_t length, bool contiguous) {
+            std::vector<uint8_t> data;
+            auto n = first;
+            while (data.size() < length) {
+                if (n < 2 || n >= cluster_count + 2) {
+                    return std::vector<uint8_t>{};
+                }
+                const auto part = load(disk, heap + (n - 2) * cluster, std::min<uint64_t>(cluster, length - data.size()));
+                if (part.empty()) {
+                    return part;
+                }
+                data.insert(data.end(), part.begin(), part.end());
+                n = contiguous ? n + 1 : le<uint32_t>(fat, 4 * n);
+            }
+            return data;
+        };
+
+        // the allocation bitmap is a directory entry of the root directory
+        std::vector<uint8_t> bitmap;
+        auto n = root;
+        for (uint32_t visited = 0; !bitmap.size() && visited < cluster_count && n >= 2 && n < cluster_count + 2; ++visited) {
+            const auto directory = load(disk, heap + (n - 2) * cluster, cluster);
+            if (directory.empty()) {
+                return {};
+            }
+            bool end = false;
+            for (size_t e = 0; e + 32 <= directory.size(); e += 32) {
+                const auto type = directory[e];
+                if (type == 0x00) {
+                    end = true;
+                    break;
+                }
+                if (type == 0x81) {
+                    const auto entry = std::span<const uint8_t>(directory).subspan(e, 32);
+                    const auto length = le<uint64_t>(entry, 24);
+                    if (length < (cluster_count + 7) / 8) {
+                        return {};
+                    }
+                    bitmap = read_chain(le<uint32_t>(entry, 20), length, entry[1] & 0x2);
+                    if (bitmap.empty()) {
+                        return {};
+                    }
+                    break;
+                }
+            }
+            if (end) {
+                break;
+            }
+            n = le<uint32_t>(fat, 4 * n);
+        }
+        if (bitmap.empty()) {
+            return {};
+        }
+
+        free_list list("exfat", cluster);
+        list.add_bitmap(bitmap, cluster_count, heap);
+        return list;
+    }
+
+    // https://academy.cba.mit.edu/classes/networking_communications/SD/FAT.pdf
+    std::optional<free_list> read_fat(const input& disk, const partition& p) {
+        const auto boot = load(disk, p.offset, SECTOR);
+        if (boot.empty() || le<uint16_t>(boot, 510) != 0xAA55) {
+            return {};
+        }
+        const uint32_t bytes_per_sector = le<uint16_t>(boot, 11);
+        const uint32_t sectors_per_cluster = le<uint8_t>(boot, 13);
+        const uint32_t reserved = le<uint16_t>(boot, 14);
+        const uint32_t fats = le<uint8_t>(boot, 16);
+        const uint32_t root_entries = le<uint16_t>(boot, 17);
+        const uint32_t total = le<uint16_t>(boot, 19) ? le<uint16_t>(boot, 19) : le<uint32_t>(boot, 32);
+        const auto media = le<uint8_t>(boot, 21);
+        const uint32_t fat_size = le<uint16_t>(boot, 22) ? le<uint16_t>(boot, 22) : le<uint32_t>(boot, 36);
+        if (
+            bytes_per_sector < 512 || bytes_per_sector > 4096 || !std::has_single_bit(bytes_per_sector) ||
+            !std::has_single_bit(sectors_per_cluster) ||
+            reserved == 0 || fats == 0 || fats > 2 || fat_size == 0 ||
+            (media != 0xF0 && media < 0xF8) ||
+            uint64_t(total) * bytes_per_sector > p.length
+        ) {
+            return {};
+        }
+        const uint32_t root_sectors = (root_entries * 32 + bytes_per_sector - 1) / bytes_per_sector;
+        const uint64_t data_start = reserved + uint64_t(fats) * fat_size + root_sectors;
+        if (data_start >= total) {
+            return {};
+        }
+        const uint64_t clusters = (total - data_start) / sectors_per_cluster;
+        const int bits = clusters < 4085 ? 12 : clusters < 65525 ? 16 : 32;
+        const auto fat = load(disk, p.offset + uint64_t(reserved) * bytes_per_sector, uint64_t(fat_size) * bytes_per_sector);
+        if (fat.empty() || fat.size() * 8 < (clusters + 2) * bits) {
+            return {};
+        }
+
+        const uint64_t cluster = uint64_t(bytes_per_sector) * sectors_per_cluster;
+        const uint64_t heap = p.offset + data_start * bytes_per_sector;
+        free_list list("fat", cluster);
+        for (uint64_t n = 2; n < clusters + 2; ++n) {
+            uint32_t entry = 0;
+            if (bits == 12) {
+                const auto v = le<uint16_t>(fat, n + n / 2);
+                entry = n & 1 ? v >> 4 : v & 0xFFF;
+            } else if (bits == 16) {
+                entry = le<uint16_t>(fat, 2 * n);
+            } else {
+                entry = le<uint32_t>(fat, 4 * n) & 0x0FFFFFFF;
+            }
+            if (entry == 0) {
+                list.add(heap + (n - 2) * cluster, 1);
+            }
+        }
+        return list;
+    }
+
+    // the free clusters of the filesystem in p, nothing if it isn't one we know
+    std::optional<free_list> read_filesystem(const input& disk, const partition& p) {
+        for (auto read : { read_ntfs, read_exfat, read_ext, read_fat }) {
+            if (auto list = read(disk, p)) {
+                return list;
+            }
+        }
+        return {};
+    }
+
+    // https://uefi.org/specs/UEFI/2.10/05_GUID_Partition_Table_Format.html
+    bool read_gpt(const input& disk, uint64_t sector, std::vector<partition>& partitions) {
+        const auto header = load(disk, sector, 92);
+        if (header.empty() || std::memcmp(header.data(), "EFI PART", 8) != 0) {
+            return false;
+        }
+        const auto entries_lba = le<uint64_t>(header, 72);
+        const auto count = le<uint32_t>(header, 80);
+        const auto entry_size = le<uint32_t>(header, 84);
+        if (entry_size < 128 || count > 4096) {
+            return false;
+        }
+        const auto entries = load(disk, entries_lba * sector, uint64_t(count) * entry_size);
+        if (entries.empty()) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            const auto entry = std::span<const uint8_t>(entries).subspan(i * entry_size, entry_size);
+            if (std::all_of(entry.begin(), entry.begin() + 16, [](uint8_t b) { return b == 0; })) {
+                // unused
+                continue;
+            }
+            const auto first = le<uint64_t>(entry, 32);
+            const auto last = le<uint64_t>(entry, 40);
+            if (last < first) {
+                continue;
+            }
+            partitions.push_back({ first * sector, (last - first + 1) * sector });
+        }
+        return true;
+    }
+
+    // https://en.wikipedia.org/wiki/Master_boot_record
+    bool read_mbr(const input& disk, std::vector<partition>& partitions) {
+        const auto mbr = load(disk, 0, SECTOR);
+        if (mbr.empty() || le<uint16_t>(mbr, 510) != 0xAA55) {
+            return false;
+        }
+        for (int i = 0; i < 4; ++i) {
+            if (mbr[446 + 16 * i] & 0x7F) {
+                // status is 0x00 or 0x80, probably a boot sector
+                return false;
+            }
+        }
+        for (int i = 0; i < 4; ++i) {
+            const auto entry = std::span<const uint8_t>(mbr).subspan(446 + 16 * i, 16);
+            const auto type = entry[4];
+            const uint64_t first = le<uint32_t>(entry, 8);
+            const uint64_t sectors = le<uint32_t>(entry, 12);
+            if (type == 0 || sectors == 0) {
+                continue;
+            }
+            if (type == 0xEE) {
+                // protective MBR
+                return read_gpt(disk, SECTOR, partitions) || read_gpt(disk, 4096, partitions);
+            }
+            if (type == 0x05 || type == 0x0F || type == 0x85) {
+                // extended, a chain of EBRs with one logical partition each
+                auto ebr_sector = first;
+                for (int n = 0; n < 128 && ebr_sector; ++n) {
+                    const auto ebr = load(disk, ebr_sector * SECTOR, SECTOR);
+                    if (ebr.empty() || le<uint16_t>(ebr, 510) != 0xAA55) {
+                        break;
+                    }
+                    const auto logical = std::span<const uint8_t>(ebr).subspan(446, 16);
+                    const auto next = std::span<const uint8_t>(ebr).subspan(462, 16);
+                    if (logical[4] && le<uint32_t>(logical, 12)) {
+                        partitions.push_back({ (ebr_sector + le<uint32_t>(logical, 8)) * SECTOR, uint64_t(le<uint32_t>(logical, 12)) * SECTOR });
+                    }
+                    ebr_sector = next[4] ? first + le<uint32_t>(next, 8) : 0;
+                }
+                continue;
+            }
+            partitions.push_back({ first * SECTOR, sectors * SECTOR });
+        }
+        return true;
+    }
+}
+
+std::vector<range> unallocated(const input& disk, const char* name) {
+    const auto size = disk.size();
+    std::vector<partition> partitions;
+    if (auto whole = read_filesystem(disk, { 0, size })) {
+        // a partition image without a table
+        fprintf(stderr, "%s: %s, %u byte clusters\n", name, whole->name, whole->cluster);
+        return std::move(whole->ranges);
+    }
+    if (!read_mbr(disk, partitions)) {
+        fprintf(stderr, "%s: no partition table or filesystem found, scanning everything\n", name);
+        return { { 0, size } };
+    }
+
+    std::sort(partitions.begin(), partitions.end(), [](auto& a, auto& b) { return a.offset < b.offset; });
+    std::vector<range> ranges;
+    uint64_t cursor = 0;
+    for (size_t i = 0; i < partitions.size(); ++i) {
+        auto p = partitions[i];
+        // overlapping or cut off partitions are clamped
+        const auto end = std::min(p.offset + p.length, size);
+        p.offset = std::max(p.offset, cursor);
+        if (end <= p.offset) {
+            continue;
+        }
+        p.length = end - p.offset;
+        if (p.offset > cursor) {
+            // not part of any partition
+            ranges.push_back({ cursor, p.offset - cursor });
+        }
+        cursor = p.offset + p.length;
+
+        const auto list = read_filesystem(disk, p);
+        if (!list) {
+            fprintf(stderr, "%s: partition %zu unknown filesystem, scanning all of it\n", name, i + 1);
+            ranges.push_back({ p.offset, p.length });
+            continue;
+        }
+        uint64_t free = 0;
+        for (auto& r : list->ranges) {
+            free += r.length;
+        }
+        fprintf(stderr, "%s: partition %zu %s, %u byte clusters, %s unallocated\n", name, i + 1, list->name, list->cluster, format_bytes(free, false).c_str());
+        ranges.insert(ranges.end(), list->ranges.begin(), list->ranges.end());
+    }
+    if (cursor < size) {
+        ranges.push_back({ cursor, size - cursor });
+    }
+    return ranges;
+}
@@ -0,0 +1,15 @@
+#ifndef H_ALLOCATION
+#define H_ALLOCATION
+
+#include <vector>
+#include "input.h"
+#include "range.h"
+
+// reads the partition table (MBR, GPT) and the allocation maps of the filesystems on it
+// (ext2/3/4 block bitmaps, NTFS $Bitmap, FAT12/16/32, exFAT)
+// returns the free clusters aligned to the cluster size, sorted by offset
+// unknown partitions and space outside of partitions are returned as a whole
+// name is used for the summary printed to stderr
+std::vector<range> unallocated(const input& disk, const char* name);
+
+#endif
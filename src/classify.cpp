@@ -0,0 +1,159 @@
+#include "classify.h"
+#include <cmath>
+#include <future>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+    // regions per task, every task has a buffer of this many samples
+    constexpr size_t REGIONS_PER_TASK = 16;
+
+    constexpr double FILL_RATIO = 0.9;
+    constexpr double TEXT_RATIO = 0.9;
+    // a uniform sample of SAMPLE_SIZE bytes measures about 7.997
+    constexpr double RANDOM_ENTROPY = 7.99;
+    constexpr double MEDIA_ENTROPY = 7.0;
+
+    // four histograms side by side, runs of the same byte don't wait on one counter
+    void histogram(std::span<const uint8_t> data, uint32_t (&counts)[256]) {
+        uint32_t partial[4][256] = {};
+        size_t i = 0;
+        for (; i + 4 <= data.size(); i += 4) {
+            ++partial[0][data[i]];
+            ++partial[1][data[i + 1]];
+            ++partial[2][data[i + 2]];
+            ++partial[3][data[i + 3]];
+        }
+        for (; i < data.size(); ++i) {
+            ++partial[0][data[i]];
+        }
+        for (int b = 0; b < 256; ++b) {
+            counts[b] = partial[0][b] + partial[1][b] + partial[2][b] + partial[3][b];
+        }
+    }
+
+    void measure(region& r, std::span<const uint8_t> sample, bool (*starts)(std::span<const uint8_t> data)) {
+        uint32_t counts[256];
+        histogram(sample, counts);
+        const double n = sample.size();
+        double entropy = 0;
+        uint32_t most = 0;
+        uint32_t ascii = counts['\t'] + counts['\n'] + counts['\r'];
+        for (int b = 0; b < 256; ++b) {
+            if (counts[b]) {
+                const auto p = counts[b] / n;
+                entropy -= p * std::log2(p);
+            }
+            most = std::max(most, counts[b]);
+            if (b >= 0x20 && b < 0x7F) {
+                ascii += counts[b];
+            }
+        }
+        r.entropy = entropy;
+        r.zeros = counts[0] / n;
+        r.ascii = ascii / n;
+        for (size_t i = 0; i < sample.size(); ++i) {
+            if (starts(sample.subspan(i))) {
+                ++r.headers;
+            }
+        }
+        if (most >= FILL_RATIO * n) {
+            r.kind = REGION_FILL;
+        } else if (r.ascii >= TEXT_RATIO) {
+            r.kind = REGION_TEXT;
+        } else if (entropy >= RANDOM_ENTROPY) {
+            r.kind = REGION_RANDOM;
+        } else if (entropy >= MEDIA_ENTROPY) {
+            r.kind = REGION_MEDIA;
+        } else {
+            r.kind = REGION_OTHER;
+        }
+    }
+
+    // the pass of a region, regions continuing one with headers go with it
+    size_t pass(const region& r, const region* previous) {
+        if (r.headers) {
+            return 0;
+        }
+        if (r.kind == REGION_MEDIA && previous && previous->headers && previous->offset + previous->length == r.offset) {
+            return 0;
+        }
+        if (r.kind == REGION_MEDIA || r.kind == REGION_OTHER) {
+            return 1;
+        }
+        return 2;
+    }
+}
+
+std::vector<region> classify(const input& disk, const std::vector<range>& ranges, worker_pool& pool, bool (*starts)(std::span<const uint8_t> data)) {
+    // the sample starts where the first range enters the region
+    std::vector<region> regions;
+    std::vector<uint64_t> samples;
+    for (const auto& r : ranges) {
+        if (r.length == 0) {
+            continue;
+        }
+        for (auto index = r.offset / REGION_SIZE; index <= (r.end() - 1) / REGION_SIZE; ++index) {
+            const auto offset = index * REGION_SIZE;
+            if (!regions.empty() && regions.back().offset == offset) {
+                continue;
+            }
+            regions.push_back({ offset, std::min<uint64_t>(REGION_SIZE, disk.size() - offset), 0, 0, 0, 0, REGION_OTHER });
+            samples.push_back(std::max(offset, r.offset));
+        }
+    }
+
+    std::vector<std::future<void>> tasks;
+    for (size_t first = 0; first < regions.size(); first += REGIONS_PER_TASK) {
+        tasks.push_back(pool.submit([&disk, &regions, &samples, first, starts] {
+            const auto last = std::min(regions.size(), first + REGIONS_PER_TASK);
+            std::vector<uint8_t> buffer(SAMPLE_SIZE);
+            for (auto i = first; i < last; ++i) {
+                auto& r = regions[i];
+                const auto length = std::min<uint64_t>(SAMPLE_SIZE, r.offset + r.length - samples[i]);
+                // unreadable samples are left as other regions
+                if (length && disk.read(samples[i], buffer.data(), length)) {
+                    measure(r, std::span<const uint8_t>(buffer).first(length), starts);
+                }
+            }
+        }));
+    }
+    for (auto& t : tasks) {
+        t.get();
+    }
+    return regions;
+}
+
+std::vector<std::vector<range>> prioritize(const std::vector<range>& ranges, const std::vector<region>& regions) {
+    std::vector<range> parts[3];
+    for (size_t i = 0; i < regions.size(); ++i) {
+        const auto& r = regions[i];
+        auto& part = parts[pass(r, i ? &regions[i - 1] : nullptr)];
+        if (!part.empty() && part.back().end() == r.offset) {
+            part.back().length += r.length;
+        } else {
+            part.push_back({ r.offset, r.length });
+        }
+    }
+    std::vector<std::vector<range>> passes;
+    for (const auto& part : parts) {
+        auto p = intersect(ranges, part);
+        if (!p.empty()) {
+            passes.push_back(std::move(p));
+        }
+    }
+    return passes;
+}
+
+void store_heatmap(const std::string& path, const std::vector<region>& regions) {
+    auto file = fopen(path.c_str(), "w");
+    if (!file) {
+        fprintf(stderr, "couldn't create %s\n", path.c_str());
+        exit(-1);
+    }
+    fprintf(file, "offset\tlength\tkind\tentropy\tzeros\tascii\theaders\n");
+    for (const auto& r : regions) {
+        fprintf(file, "%lu\t%lu\t%s\t%.3f\t%.3f\t%.3f\t%u\n", r.offset, r.length, REGION_NAMES[r.kind], r.entropy, r.zeros, r.ascii, r.headers);
+    }
+    fclose(file);
+}
@@ -0,0 +1,48 @@
+#ifndef H_CLASSIFY
+#define H_CLASSIFY
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+#include "input.h"
+#include "range.h"
+#include "worker_pool.h"
+
+// --priority measures a sample of every region before the scan
+constexpr size_t REGION_SIZE = 4 * 1024 * 1024;
+constexpr size_t SAMPLE_SIZE = 64 * 1024;
+
+// what the sample of a region looks like
+enum REGION {
+    REGION_FILL,    // mostly one byte, e.g. zeros or erased flash
+    REGION_TEXT,    // mostly printable ascii, e.g. logs
+    REGION_RANDOM,  // as good as uniform, e.g. encrypted or deflated
+    REGION_MEDIA,   // high entropy, but not uniform like compressed image data
+    REGION_OTHER,   // executables, databases, ..
+    REGION_COUNT
+};
+
+constexpr const char* REGION_NAMES[REGION_COUNT] = { "fill", "text", "random", "media", "other" };
+
+struct region {
+    uint64_t offset;
+    uint64_t length;
+    float entropy;      // bits per byte
+    float zeros;        // fraction of the sample
+    float ascii;
+    uint32_t headers;   // offsets in the sample that start like an image
+    REGION kind;
+};
+
+// one region per REGION_SIZE of the disk image that overlaps ranges, the samples are read on the pool
+// starts tells whether data starts like an image of a selected format
+std::vector<region> classify(const input& disk, const std::vector<range>& ranges, worker_pool& pool, bool (*starts)(std::span<const uint8_t> data));
+
+// splits ranges into the passes of the scan, the most productive regions first
+// regions with headers come first, then media and other regions, fill, text and random ones last
+std::vector<std::vector<range>> prioritize(const std::vector<range>& ranges, const std::vector<region>& regions);
+
+void store_heatmap(const std::string& path, const std::vector<region>& regions);
+
+#endif
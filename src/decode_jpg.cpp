@@ -0,0 +1,329 @@
+#include "decode_jpg.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+    // returned instead of a value
+    constexpr int BROKEN = -1;
+    constexpr int END = -2;
+
+    // based on https://www.w3.org/Graphics/JPEG/itu-t81.pdf annex C and F.2.2
+}
+
+bool jpg_decoder::open(std::span<const uint8_t> jpg) {
+    if (jpg.size() < 4 || jpg[0] != 0xFF || jpg[1] != 0xD8) {
+        return false;
+    }
+    size_t p = 2;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    int frame_components = 0;
+    while (true) {
+        while (p + 1 < jpg.size() && jpg[p] == 0xFF && jpg[p + 1] == 0xFF) {
+            ++p;
+        }
+        if (p + 4 > jpg.size() || jpg[p] != 0xFF) {
+            return false;
+        }
+        const auto marker = jpg[p + 1];
+        const size_t length = (jpg[p + 2] << 8) | jpg[p + 3];
+        if (length < 2 || p + 2 + length > jpg.size()) {
+            return false;
+        }
+        const auto segment = jpg.subspan(p + 4, length - 2);
+        p += 2 + length;
+
+        if (marker == 0xC0 || marker == 0xC1) {
+            if (frame_components || segment.size() < 6) {
+                return false;
+            }
+            precision = segment[0];
+            height = (segment[1] << 8) | segment[2];
+            width = (segment[3] << 8) | segment[4];
+            frame_components = segment[5];
+            if ((precision != 8 && precision != 12) || width == 0 || height == 0 || frame_components == 0 || frame_components > 4 || segment.size() != 6u + 3 * frame_components) {
+                return false;
+            }
+            for (int i = 0; i < frame_components; ++i) {
+                auto& c = components[i];
+                c.id = segment[6 + 3 * i];
+                c.h = segment[7 + 3 * i] >> 4;
+                c.v = segment[7 + 3 * i] & 15;
+                if (c.h == 0 || c.h > 4 || c.v == 0 || c.v > 4) {
+                    return false;
+                }
+            }
+        } else if ((marker & 0xF0) == 0xC0 && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            // progressive, lossless, hierarchical or arithmetic
+            return false;
+        } else if (marker == 0xC4) {
+            size_t q = 0;
+            while (q < segment.size()) {
+                if (q + 17 > segment.size()) {
+                    return false;
+                }
+                const auto cls = segment[q] >> 4;
+                const auto id = segment[q] & 15;
+                if (cls > 1 || id > 3) {
+                    return false;
+                }
+                auto& table = cls ? ac_tables[id] : dc_tables[id];
+                size_t values = 0;
+                int32_t code = 0;
+                for (int l = 1; l <= 16; ++l) {
+                    const auto n = segment[q + l];
+                    table.valptr[l] = values;
+                    table.mincode[l] = code;
+                    code += n;
+                    values += n;
+                    table.maxcode[l] = n ? code - 1 : -1;
+                    if (code > (1 << l) || values > 256) {
+                        return false;
+                    }
+                    code <<= 1;
+                }
+                if (q + 17 + values > segment.size()) {
+                    return false;
+                }
+                std::copy_n(segment.begin() + q + 17, values, table.values);
+                // codes up to FAST_BITS long are looked up in one step
+                std::fill(std::begin(table.fast), std::end(table.fast), 0);
+                for (int l = 1; l <= FAST_BITS; ++l) {
+                    for (auto code = table.mincode[l]; code <= table.maxcode[l]; ++code) {
+                        const auto shift = FAST_BITS - l;
+                        const uint16_t entry = (l << 8) | table.values[table.valptr[l] + code - table.mincode[l]];
+                        std::fill_n(table.fast + (code << shift), 1 << shift, entry);
+                    }
+                }
+                table.defined = true;
+                q += 17 + values;
+            }
+        } else if (marker == 0xDD) {
+            if (segment.size() != 2) {
+                return false;
+            }
+            interval = (segment[0] << 8) | segment[1];
+        } else if (marker == 0xDA) {
+            if (!frame_components || segment.empty()) {
+                return false;
+            }
+            count = segment[0];
+            if (segment.size() != 4u + 2 * count || count != frame_components) {
+                return false;
+            }
+            // the scan has every component of the frame, in order
+            for (int i = 0; i < count; ++i) {
+                auto& c = components[i];
+                if (segment[1 + 2 * i] != c.id) {
+                    return false;
+                }
+                c.dc = segment[2 + 2 * i] >> 4;
+                c.ac = segment[2 + 2 * i] & 15;
+                if (c.dc > 3 || c.ac > 3 || !dc_tables[c.dc].defined || !ac_tables[c.ac].defined) {
+                    return false;
+                }
+            }
+            offset = p;
+            break;
+        } else if (marker == 0xD8 || marker == 0xD9 || (marker >= 0xD0 && marker <= 0xD7) || marker == 0x00 || marker == 0xDC) {
+            return false;
+        }
+        // DQT, APPn, COM, ..
+    }
+
+    if (count == 1) {
+        // not interleaved, one block per MCU whatever the sampling factors say
+        total = uint32_t((width + 7) / 8) * ((height + 7) / 8);
+        components[0].h = 1;
+        components[0].v = 1;
+    } else {
+        uint8_t hmax = 0;
+        uint8_t vmax = 0;
+        for (int i = 0; i < count; ++i) {
+            hmax = std::max(hmax, components[i].h);
+            vmax = std::max(vmax, components[i].v);
+        }
+        total = uint32_t((width + 8 * hmax - 1) / (8 * hmax)) * ((height + 8 * vmax - 1) / (8 * vmax));
+    }
+    return true;
+}
+
+jpg_decoder::state jpg_decoder::start() const {
+    state s;
+    s.left = interval;
+    return s;
+}
+
+// reads ahead up to a marker or the end of the stream
+void jpg_decoder::fill(state& s, const jpg_stream& stream) const {
+    while (s.count <= 56 && s.pos < stream.size()) {
+        const auto byte = stream[s.pos];
+        if (byte == 0xFF) {
+            if (s.pos + 1 >= stream.size() || stream[s.pos + 1] != 0x00) {
+                break;
+            }
+            ++s.pos;
+        }
+        ++s.pos;
+        s.bits = (s.bits << 8) | byte;
+        s.count += 8;
+    }
+}
+
+// why there are no more bits, a marker in the middle of an MCU or the end of the stream
+int jpg_decoder::stopped(const state& s, const jpg_stream& stream) const {
+    return s.pos + 1 >= stream.size() ? END : BROKEN;
+}
+
+int jpg_decoder::receive(state& s, const jpg_stream& stream, int length) const {
+    if (s.count < length) {
+        fill(s, stream);
+        if (s.count < length) {
+            return stopped(s, stream);
+        }
+    }
+    s.count -= length;
+    return (s.bits >> s.count) & ((1u << length) - 1);
+}
+
+int jpg_decoder::decode(state& s, const jpg_stream& stream, const huffman& table) const {
+    if (s.count < 16) {
+        fill(s, stream);
+    }
+    if (s.count >= FAST_BITS) {
+        const auto entry = table.fast[(s.bits >> (s.count - FAST_BITS)) & ((1u << FAST_BITS) - 1)];
+        if (entry) {
+            s.count -= entry >> 8;
+            return entry & 0xFF;
+        }
+    }
+    int32_t code = 0;
+    for (int l = 1; l <= 16; ++l) {
+        if (s.count == 0) {
+            return stopped(s, stream);
+        }
+        --s.count;
+        code = (code << 1) | ((s.bits >> s.count) & 1);
+        if (code <= table.maxcode[l]) {
+            return table.values[table.valptr[l] + code - table.mincode[l]];
+        }
+    }
+    return BROKEN;
+}
+
+int jpg_decoder::block(state& s, const jpg_stream& stream, const component& c, int& dc) const {
+    const auto t = decode(s, stream, dc_tables[c.dc]);
+    if (t < 0) {
+        return t;
+    }
+    if (t > precision + 3) {
+        return BROKEN;
+    }
+    auto diff = receive(s, stream, t);
+    if (diff < 0) {
+        return diff;
+    }
+    if (t && diff < (1 << (t - 1))) {
+        diff -= (1 << t) - 1;
+    }
+    dc += diff;
+    if (std::abs(dc) > (1 << (precision + 3))) {
+        return BROKEN;
+    }
+
+    int k = 1;
+    while (k < 64) {
+        const auto rs = decode(s, stream, ac_tables[c.ac]);
+        if (rs < 0) {
+            return rs;
+        }
+        const auto r = rs >> 4;
+        const auto size = rs & 15;
+        if (size == 0) {
+            if (r != 15) {
+                break; // EOB
+            }
+            k += 16;
+            continue;
+        }
+        k += r;
+        if (k > 63 || size > precision + 2) {
+            return BROKEN;
+        }
+        const auto v = receive(s, stream, size);
+        if (v < 0) {
+            return v;
+        }
+        ++k;
+    }
+    return k > 64 ? BROKEN : 0;
+}
+
+// the padding up to the marker is all ones, fill bytes may come before it
+int jpg_decoder::marker(state& s, const jpg_stream& stream, uint8_t expected) const {
+    fill(s, stream);
+    if (s.count >= 8 || (s.bits & ((1u << s.count) - 1)) != (1u << s.count) - 1) {
+        return BROKEN;
+    }
+    s.count = 0;
+    while (s.pos + 1 < stream.size() && stream[s.pos] == 0xFF && stream[s.pos + 1] == 0xFF) {
+        ++s.pos;
+    }
+    if (s.pos + 1 >= stream.size()) {
+        return END;
+    }
+    if (stream[s.pos] != 0xFF || stream[s.pos + 1] != expected) {
+        return BROKEN;
+    }
+    s.pos += 2;
+    return 0;
+}
+
+jpg_decoder::result jpg_decoder::run(state& s, const jpg_stream& stream, std::deque<state>* checkpoints, size_t keep) const {
+    const auto finish = [](int status) {
+        return status == END ? MORE : FAILED;
+    };
+    while (true) {
+        if (s.mcu == total) {
+            const auto status = marker(s, stream, 0xD9);
+            return status < 0 ? finish(status) : DONE;
+        }
+        if (interval && s.left == 0) {
+            const auto status = marker(s, stream, 0xD0 + s.rst);
+            if (status < 0) {
+                return finish(status);
+            }
+            s.rst = (s.rst + 1) & 7;
+            s.left = interval;
+            s.marker = s.pos;
+            std::fill(std::begin(s.dc), std::end(s.dc), 0);
+        }
+        if (checkpoints) {
+            while (!checkpoints->empty() && checkpoints->front().pos + keep < s.pos) {
+                checkpoints->pop_front();
+            }
+            checkpoints->push_back(s);
+        }
+        for (int i = 0; i < count; ++i) {
+            const auto& c = components[i];
+            for (int b = 0; b < c.h * c.v; ++b) {
+                const auto status = block(s, stream, c, s.dc[i]);
+                if (status < 0) {
+                    return finish(status);
+                }
+            }
+        }
+        ++s.mcu;
+        --s.left;
+    }
+}
+
+bool check_jpg_data(std::span<const uint8_t> jpg) {
+    jpg_decoder decoder;
+    if (!decoder.open(jpg)) {
+        return true;
+    }
+    auto s = decoder.start();
+    const jpg_stream stream{ jpg.subspan(decoder.data()) };
+    return decoder.run(s, stream) == jpg_decoder::DONE && s.pos == stream.size();
+}
@@ -0,0 +1,97 @@
+#ifndef H_DECODE_JPG
+#define H_DECODE_JPG
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <span>
+
+// entropy coded data that may be split in two, e.g. the end of one fragment and the start of the next
+struct jpg_stream {
+    std::span<const uint8_t> head;
+    std::span<const uint8_t> tail = {};
+
+    size_t size() const {
+        return head.size() + tail.size();
+    }
+    uint8_t operator[](size_t i) const {
+        return i < head.size() ? head[i] : tail[i - head.size()];
+    }
+};
+
+// huffman decoder of sequential jpegs (SOF0, SOF1) with one scan, without output
+// checks what a broken stream trips over: unknown codes, more than 64 coefficients,
+// dc values out of range, padding, restart markers out of order and the number of MCUs
+class jpg_decoder {
+public:
+    // where the decoder stands, a copy resumes from there on another stream
+    struct state {
+        size_t pos = 0;      // next byte of the stream
+        size_t marker = 0;   // after the last restart marker
+        uint64_t bits = 0;
+        int count = 0;       // bits read ahead and not used yet
+        int dc[4] = {};
+        uint32_t mcu = 0;    // MCUs decoded
+        uint32_t left = 0;   // MCUs up to the next restart marker
+        uint8_t rst = 0;     // index of the next restart marker
+    };
+
+    enum result {
+        DONE,   // EOI after the last MCU, pos is after it
+        FAILED, // pos is about where the stream broke
+        MORE    // the stream ended first
+    };
+
+    // reads the segments up to the first SOS, false for anything this can't decode
+    bool open(std::span<const uint8_t> jpg);
+    // offset of the entropy coded data in the jpg
+    size_t data() const {
+        return offset;
+    }
+    bool restarts() const {
+        return interval != 0;
+    }
+    state start() const;
+    // keeps the state at the start of every MCU in checkpoints, without those more than keep bytes behind
+    result run(state& s, const jpg_stream& stream, std::deque<state>* checkpoints = nullptr, size_t keep = 0) const;
+
+private:
+    static constexpr int FAST_BITS = 9;
+
+    struct huffman {
+        uint16_t fast[1 << FAST_BITS]; // length << 8 | value, 0 for longer codes
+        int32_t maxcode[17];
+        int32_t mincode[17];
+        uint8_t valptr[17];
+        uint8_t values[256];
+        bool defined = false;
+    };
+    struct component {
+        uint8_t id;
+        uint8_t h;
+        uint8_t v;
+        uint8_t dc;
+        uint8_t ac;
+    };
+
+    void fill(state& s, const jpg_stream& stream) const;
+    int stopped(const state& s, const jpg_stream& stream) const;
+    int receive(state& s, const jpg_stream& stream, int length) const;
+    int decode(state& s, const jpg_stream& stream, const huffman& table) const;
+    int block(state& s, const jpg_stream& stream, const component& c, int& dc) const;
+    int marker(state& s, const jpg_stream& stream, uint8_t expected) const;
+
+    huffman dc_tables[4];
+    huffman ac_tables[4];
+    component components[4];
+    int count = 0;           // components of the scan
+    uint8_t precision = 8;
+    uint32_t interval = 0;
+    uint32_t total = 0;      // MCUs in the scan
+    size_t offset = 0;
+};
+
+// decodes the scan of a jpg returned by read_jpg, true if it ends at its EOI or can't be decoded here
+bool check_jpg_data(std::span<const uint8_t> jpg);
+
+#endif
@@ -0,0 +1,62 @@
+#include "fragment.h"
+#include "parsers.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    constexpr uint64_t PROBE_MIN = 64 * 1024;
+
+    // a cluster starting with 16 zeros is empty
+    bool zero(const uint8_t* p) {
+        static const uint8_t zeros[16] = {};
+        return memcmp(p, zeros, sizeof(zeros)) == 0;
+    }
+
+    // first offset >= offset on the grid step, phase
+    uint64_t align_up(uint64_t offset, uint64_t step, uint64_t phase) {
+        if (offset <= phase) {
+            return phase;
+        }
+        return (offset - phase + step - 1) / step * step + phase;
+    }
+}
+
+uint32_t cluster_at(const fragment_search& search, uint64_t start) {
+    const auto r = std::upper_bound(search.space.begin(), search.space.end(), start, [](uint64_t o, const range& r) { return o < r.end(); });
+    if (r != search.space.end() && r->offset <= start && r->alignment > 1) {
+        return r->alignment;
+    }
+    return search.cluster;
+}
+
+candidates::candidates(const fragment_search& search, uint64_t after) : search(search), phase(after % cluster_at(search, after)) {
+    r = std::upper_bound(search.space.begin(), search.space.end(), after, [](uint64_t o, const range& r) { return o < r.end(); }) - search.space.begin();
+    offset = after + 1;
+}
+
+std::optional<uint64_t> candidates::next() {
+    while (r < search.space.size()) {
+        if (search.expired()) {
+            return {};
+        }
+        const auto& range = search.space[r];
+        const uint64_t step = range.alignment > 1 ? range.alignment : search.cluster;
+        const auto first = range.alignment > 1 ? align_up(offset, step, range.offset % step) : align_up(offset, step, phase);
+        const auto c = std::max(first, range.alignment > 1 ? range.offset : align_up(range.offset, step, phase));
+        if (c + 16 > std::min<uint64_t>(range.end(), search.disk.size())) {
+            ++r;
+            continue;
+        }
+        offset = c + 1;
+        // the pieces are tested on a couple of clusters from there
+        const auto probe = search.disk.subspan(c, std::min<uint64_t>(std::max<uint64_t>(2 * step, PROBE_MIN), search.disk.size() - c));
+        if (search.unreadable && search.unreadable->readable(probe) < probe.size()) {
+            continue;
+        }
+        // a cluster that starts an image is a file of its own
+        if (!starts_image(search.disk.subspan(c)) && !zero(search.disk.data() + c)) {
+            return c;
+        }
+    }
+    return {};
+}
@@ -0,0 +1,58 @@
+#ifndef H_FRAGMENT
+#define H_FRAGMENT
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+#include "image_info.h"
+#include "range.h"
+#include "unreadable.h"
+
+// a file that was reassembled from pieces of the disk image, in order
+struct reassembled {
+    std::vector<uint8_t> data;
+    std::vector<range> fragments;
+    image_info info;
+};
+
+// where the search for the rest of a fragmented file runs
+struct fragment_search {
+    std::span<const uint8_t> disk;
+    const std::vector<range>& space;  // clusters that may hold a continuation, sorted by offset
+    uint32_t cluster;                 // used where space has no alignment of its own
+    std::chrono::steady_clock::time_point deadline;
+    unreadable_map* unreadable;       // candidates are probed before they are read, nullptr if disk isn't a mapping
+
+    bool expired() const {
+        return std::chrono::steady_clock::now() >= deadline;
+    }
+    // length of the part of the disk from offset on that can be read, probed first if the disk is a mapping
+    uint64_t readable(uint64_t offset, uint64_t length) const {
+        const auto data = disk.subspan(offset, std::min<uint64_t>(length, disk.size() - offset));
+        return unreadable ? unreadable->readable(data) : data.size();
+    }
+};
+
+// the clusters after a break that may continue a file, nearest first
+// skips clusters that start another image or are zero, those never continue one
+class candidates {
+public:
+    candidates(const fragment_search& search, uint64_t after);
+
+    // the next candidate, nullopt once the search space or the time budget is used up
+    std::optional<uint64_t> next();
+
+private:
+    const fragment_search& search;
+    uint64_t phase;
+    size_t r = 0;
+    uint64_t offset = 0;
+};
+
+// the cluster grid of the file starting at start, the offsets where it may break
+uint32_t cluster_at(const fragment_search& search, uint64_t start);
+
+#endif
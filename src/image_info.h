@@ -0,0 +1,31 @@
+#ifndef H_IMAGE_INFO
+#define H_IMAGE_INFO
+
+#include <cstdint>
+
+enum FORMAT {
+    JPG,
+    PNG,
+    TIF,
+    GIF,
+    WEBP,
+    BMP,
+    ICO,
+    PSD,
+    JP2,
+    JXL,
+    FORMAT_COUNT
+};
+
+// also used as file extension
+constexpr const char* FORMAT_NAMES[FORMAT_COUNT] = { "jpg", "png", "tif", "gif", "webp", "bmp", "ico", "psd", "jp2", "jxl" };
+
+// header fields the parsers pass by anyway, written to the manifest
+struct image_info {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    const char* variant = nullptr; // e.g. baseline or progressive
+    uint32_t parts = 0;            // scans of a jpeg, frames of a gif or an animated webp
+};
+
+#endif
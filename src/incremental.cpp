@@ -0,0 +1,157 @@
+#include "incremental.h"
+#include <cstring>
+#include <future>
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+namespace {
+    constexpr char MAGIC[8] = { 'K', 'R', 'I', 'H', 'A', 'S', 'H', '1' };
+    // blocks per task, every task has a buffer of this many blocks
+    constexpr size_t BLOCKS_PER_TASK = 64;
+    // blocks that couldn't be read, they count as changed on every run
+    constexpr uint64_t UNREAD_HASH = UINT64_MAX;
+
+    // crc32 and adler32 side by side, zlib has fast versions of both
+    // the two halves of adler32 stay below 65521, so no block hashes to UNREAD_HASH
+    uint64_t hash(const uint8_t* data, size_t length) {
+        const uint64_t crc = crc32_z(0, data, length);
+        const uint64_t adler = adler32_z(1, data, length);
+        return (crc << 32) | adler;
+    }
+}
+
+std::vector<uint64_t> hash_blocks(const input& disk, worker_pool& pool) {
+    const auto blocks = (disk.size() + HASH_BLOCK - 1) / HASH_BLOCK;
+    std::vector<uint64_t> hashes(blocks);
+    std::vector<std::future<void>> tasks;
+    for (uint64_t first = 0; first < blocks; first += BLOCKS_PER_TASK) {
+        tasks.push_back(pool.submit([&disk, &hashes, first, blocks] {
+            const auto last = std::min<uint64_t>(blocks, first + BLOCKS_PER_TASK);
+            const auto offset = first * HASH_BLOCK;
+            const auto length = std::min<uint64_t>(disk.size(), last * HASH_BLOCK) - offset;
+            std::vector<uint8_t> buffer(length);
+            const bool all = disk.read(offset, buffer.data(), buffer.size());
+            for (auto b = first; b < last; ++b) {
+                const auto start = (b - first) * HASH_BLOCK;
+                const auto n = std::min<uint64_t>(HASH_BLOCK, length - start);
+                // one bad sector shouldn't cost the others their hash
+                if (!all && !disk.read(offset + start, buffer.data() + start, n)) {
+                    hashes[b] = UNREAD_HASH;
+                    continue;
+                }
+                hashes[b] = hash(buffer.data() + start, n);
+            }
+        }));
+    }
+    for (auto& t : tasks) {
+        t.get();
+    }
+    return hashes;
+}
+
+std::vector<uint64_t> load_hashes(const std::string& path) {
+    auto file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return {};
+    }
+    char magic[sizeof(MAGIC)];
+    uint64_t block = 0;
+    uint64_t count = 0;
+    std::vector<uint64_t> hashes;
+    if (
+        fread(magic, sizeof(magic), 1, file) == 1 && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 &&
+        fread(&block, sizeof(block), 1, file) == 1 && block == HASH_BLOCK &&
+        fread(&count, sizeof(count), 1, file) == 1
+    ) {
+        hashes.resize(count);
+        if (fread(hashes.data(), sizeof(uint64_t), count, file) != count) {
+            hashes.clear();
+        }
+    }
+    fclose(file);
+    return hashes;
+}
+
+void store_hashes(const std::string& path, const std::vector<uint64_t>& hashes) {
+    // replaced at once, a scan that gets interrupted keeps the old hashes
+    const auto tmp = path + ".tmp";
+    auto file = fopen(tmp.c_str(), "wb");
+    const uint64_t block = HASH_BLOCK;
+    const uint64_t count = hashes.size();
+    if (
+        !file ||
+        fwrite(MAGIC, sizeof(MAGIC), 1, file) != 1 ||
+        fwrite(&block, sizeof(block), 1, file) != 1 ||
+        fwrite(&count, sizeof(count), 1, file) != 1 ||
+        fwrite(hashes.data(), sizeof(uint64_t), count, file) != count ||
+        fclose(file) != 0 ||
+        rename(tmp.c_str(), path.c_str()) != 0
+    ) {
+        fprintf(stderr, "couldn't write %s\n", path.c_str());
+        exit(-1);
+    }
+}
+
+std::vector<range> changed_blocks(const std::vector<uint64_t>& before, const std::vector<uint64_t>& after, uint64_t size) {
+    std::vector<range> changed;
+    for (size_t b = 0; b < after.size(); ++b) {
+        if (b < before.size() && before[b] == after[b] && after[b] != UNREAD_HASH) {
+            continue;
+        }
+        const auto offset = b * HASH_BLOCK;
+        const auto length = std::min<uint64_t>(HASH_BLOCK, size - offset);
+        if (!changed.empty() && changed.back().end() == offset) {
+            changed.back().length += length;
+        } else {
+            changed.push_back({ offset, length });
+        }
+    }
+    return changed;
+}
+
+std::vector<manifest_entry> read_manifest(const std::string& path) {
+    std::vector<manifest_entry> entries;
+    auto file = fopen(path.c_str(), "r");
+    if (!file) {
+        return entries;
+    }
+    char* line = nullptr;
+    size_t capacity = 0;
+    bool header = true;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, file)) > 0) {
+        if (header) {
+            header = false;
+            continue;
+        }
+        std::string text(line, length);
+        if (text.back() == '\n') {
+            text.pop_back();
+        }
+        // name offset size format width height variant parts archive archive_offset input fragments
+        std::vector<std::string> columns;
+        size_t start = 0;
+        while (true) {
+            const auto tab = text.find('\t', start);
+            columns.push_back(text.substr(start, tab - start));
+            if (tab == std::string::npos) {
+                break;
+            }
+            start = tab + 1;
+        }
+        if (columns.size() < 3) {
+            continue;
+        }
+        entries.push_back({
+            text,
+            columns[0],
+            strtoull(columns[1].c_str(), nullptr, 10),
+            strtoull(columns[2].c_str(), nullptr, 10),
+            columns.size() > 10 ? columns[10] : std::string()
+        });
+    }
+    free(line);
+    fclose(file);
+    return entries;
+}
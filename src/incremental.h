@@ -0,0 +1,37 @@
+#ifndef H_INCREMENTAL
+#define H_INCREMENTAL
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "input.h"
+#include "range.h"
+#include "worker_pool.h"
+
+// a rescan only visits the blocks whose hash changed since the last run
+constexpr size_t HASH_BLOCK = 1024 * 1024;
+
+// one hash per HASH_BLOCK of the disk image, the blocks are hashed on the pool
+// blocks that can't be read get a hash that always counts as changed
+std::vector<uint64_t> hash_blocks(const input& disk, worker_pool& pool);
+
+// empty if the file doesn't exist or was written with another block size
+std::vector<uint64_t> load_hashes(const std::string& path);
+void store_hashes(const std::string& path, const std::vector<uint64_t>& hashes);
+
+// blocks that differ, blocks the old image didn't have or that couldn't be read count as changed
+std::vector<range> changed_blocks(const std::vector<uint64_t>& before, const std::vector<uint64_t>& after, uint64_t size);
+
+// a line of a previous manifest.tsv
+struct manifest_entry {
+    std::string line;
+    std::string name;
+    uint64_t offset;
+    uint64_t size;
+    std::string input; // empty if the manifest predates the column
+};
+
+// without the header, empty if there is no manifest
+std::vector<manifest_entry> read_manifest(const std::string& path);
+
+#endif
@@ -0,0 +1,623 @@
+#include "input.h"
+#include "utils.h"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ZLIB_CONST
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+    [[noreturn]] void fail(const char* message) {
+        fprintf(stderr, "%s\n", message);
+        exit(-1);
+    }
+
+    bool pread_all(int fd, uint8_t* buffer, size_t length, uint64_t offset) {
+        while (length) {
+            auto res = pread(fd, buffer, length, offset);
+            if (res <= 0) {
+                return false;
+            }
+            buffer += res;
+            length -= res;
+            offset += res;
+        }
+        return true;
+    }
+
+    // plain file or block device
+    class raw_input : public input {
+    public:
+        raw_input(int fd, uint64_t size) : fd(fd), raw_size(size) {}
+
+        const char* name() const override {
+            return "raw";
+        }
+
+        uint64_t size() const override {
+            return raw_size;
+        }
+
+        size_t granularity() const override {
+            return 1;
+        }
+
+        bool read(uint64_t offset, uint8_t* buffer, size_t length) const override {
+            return pread_all(fd, buffer, length, offset);
+        }
+
+    private:
+        int fd;
+        uint64_t raw_size;
+    };
+
+    // https://gitlab.com/qemu-project/qemu/-/blob/master/docs/interop/qcow2.txt
+    class qcow2_input : public input {
+    public:
+        static constexpr uint32_t MAGIC = 0x514649FB;
+
+        explicit qcow2_input(int fd) : fd(fd) {
+            uint8_t buffer[104] = {};
+            if (!pread_all(fd, buffer, sizeof(buffer), 0)) {
+                fail("couldn't read qcow2 header");
+            }
+            std::span<const uint8_t> header(buffer);
+            const auto version = peek<uint32_t, std::endian::big>(header, 4);
+            const auto backing_file_offset = peek<uint64_t, std::endian::big>(header, 8);
+            cluster_bits = peek<uint32_t, std::endian::big>(header, 20);
+            guest_size = peek<uint64_t, std::endian::big>(header, 24);
+            const auto crypt_method = peek<uint32_t, std::endian::big>(header, 32);
+            const auto l1_size = peek<uint32_t, std::endian::big>(header, 36);
+            const auto l1_offset = peek<uint64_t, std::endian::big>(header, 40);
+            if (version != 2 && version != 3) {
+                fail("unsupported qcow2 version");
+            }
+            if (backing_file_offset != 0) {
+                fail("qcow2 images with a backing file are not supported");
+            }
+            if (crypt_method != 0) {
+                fail("encrypted qcow2 images are not supported");
+            }
+            if (version == 3) {
+                // everything but the dirty bit changes how clusters are stored
+                const auto incompatible = peek<uint64_t, std::endian::big>(header, 72);
+                if (incompatible & ~uint64_t(1)) {
+                    fail("qcow2 image uses unsupported features (external data, zstd, extended L2)");
+                }
+            }
+            if (cluster_bits < 9 || cluster_bits > 21) {
+                fail("invalid qcow2 cluster size");
+            }
+            l1.resize(l1_size);
+            if (!pread_all(fd, reinterpret_cast<uint8_t*>(l1.data()), l1.size() * sizeof(uint64_t), l1_offset)) {
+                fail("couldn't read qcow2 L1 table");
+            }
+            for (auto& entry : l1) {
+                entry = convert<uint64_t, std::endian::big>(entry);
+            }
+        }
+
+        const char* name() const override {
+            return "qcow2";
+        }
+
+        uint64_t size() const override {
+            return guest_size;
+        }
+
+        size_t granularity() const override {
+            // clusters are compressed on their own, a piece smaller than what one L2 table covers
+            // only costs loading that table once more, and keeps a 64MiB window from being one task
+            return size_t(1) << cluster_bits;
+        }
+
+        bool read(uint64_t offset, uint8_t* buffer, size_t length) const override {
+            const uint64_t cluster_size = uint64_t(1) << cluster_bits;
+            const uint64_t l2_entries = cluster_size / sizeof(uint64_t);
+            std::vector<uint64_t> l2(l2_entries);
+            std::vector<uint8_t> compressed;
+            std::vector<uint8_t> cluster(cluster_size);
+            uint64_t l2_loaded = ~uint64_t(0);
+
+            while (length) {
+                const auto index = offset >> cluster_bits;
+                const auto in_cluster = offset & (cluster_size - 1);
+                const auto n = std::min<uint64_t>(length, cluster_size - in_cluster);
+                const auto l1_index = index / l2_entries;
+
+                uint64_t entry = 0;
+                if (l1_index < l1.size()) {
+                    const auto l2_offset = l1[l1_index] & 0x00FFFFFFFFFFFE00;
+                    if (l2_offset && l2_loaded != l2_offset) {
+                        if (!pread_all(fd, reinterpret_cast<uint8_t*>(l2.data()), cluster_size, l2_offset)) {
+                            return false;
+                        }
+                        l2_loaded = l2_offset;
+                    }
+                    if (l2_offset) {
+                        entry = convert<uint64_t, std::endian::big>(l2[index % l2_entries]);
+                    }
+                }
+
+                if (entry & (uint64_t(1) << 62)) {
+                    // compressed with raw deflate
+                    const auto x = 62 - (cluster_bits - 8);
+                    const auto host = entry & ((uint64_t(1) << x) - 1);
+                    const auto sectors = ((entry >> x) & ((uint64_t(1) << (cluster_bits - 8)) - 1)) + 1;
+                    compressed.resize(sectors * 512 - (host & 511));
+                    // the last sectors may be cut off at the end of the file
+                    auto res = pread(fd, compressed.data(), compressed.size(), host);
+                    if (res <= 0) {
+                        return false;
+                    }
+                    z_stream stream{};
+                    if (inflateInit2(&stream, -12) != Z_OK) {
+                        return false;
+                    }
+                    stream.next_in = compressed.data();
+                    stream.avail_in = res;
+                    stream.next_out = cluster.data();
+                    stream.avail_out = cluster.size();
+                    const auto ret = inflate(&stream, Z_FINISH);
+                    inflateEnd(&stream);
+                    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || stream.avail_out != 0) {
+                        return false;
+                    }
+                    std::memcpy(buffer, cluster.data() + in_cluster, n);
+                } else {
+                    const auto host = entry & 0x00FFFFFFFFFFFE00;
+                    const bool zero = entry & 1;
+                    if (!host || zero) {
+                        // unallocated
+                        std::memset(buffer, 0, n);
+                    } else if (!pread_all(fd, buffer, n, host + in_cluster)) {
+                        return false;
+                    }
+                }
+
+                buffer += n;
+                offset += n;
+                length -= n;
+            }
+            return true;
+        }
+
+    private:
+        int fd;
+        uint32_t cluster_bits = 16;
+        uint64_t guest_size = 0;
+        std::vector<uint64_t> l1;
+    };
+
+#ifdef HAVE_ZSTD
+    uint64_t file_size(int fd) {
+        struct stat sb;
+        fstat(fd, &sb);
+        return sb.st_size;
+    }
+
+    // https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md
+    class zstd_seekable_input : public input {
+    public:
+        static constexpr uint32_t SEEKABLE_MAGIC = 0x8F92EAB1;
+        static constexpr uint32_t SKIPPABLE_MAGIC = 0x184D2A5E;
+
+        static bool detect(int fd) {
+            uint8_t footer[9];
+            const auto size = file_size(fd);
+            return size >= sizeof(footer) + 8 &&
+                pread_all(fd, footer, sizeof(footer), size - sizeof(footer)) &&
+                peek<uint32_t, std::endian::little>(std::span<const uint8_t>(footer), 5) == SEEKABLE_MAGIC;
+        }
+
+        explicit zstd_seekable_input(int fd) : fd(fd) {
+            const auto size = file_size(fd);
+            uint8_t footer[9];
+            pread_all(fd, footer, sizeof(footer), size - sizeof(footer));
+            const auto frames = peek<uint32_t, std::endian::little>(std::span<const uint8_t>(footer), 0);
+            const auto descriptor = footer[4];
+            const size_t entry_size = (descriptor & 0x80) ? 12 : 8;
+            const uint64_t table_size = uint64_t(frames) * entry_size;
+            if (table_size + sizeof(footer) + 8 > size) {
+                fail("invalid zstd seek table");
+            }
+            std::vector<uint8_t> table(table_size + 8);
+            if (!pread_all(fd, table.data(), table.size(), size - sizeof(footer) - table.size())) {
+                fail("couldn't read zstd seek table");
+            }
+            std::span<const uint8_t> data(table);
+            if (::read<uint32_t, std::endian::little>(data) != SKIPPABLE_MAGIC) {
+                fail("invalid zstd seek table");
+            }
+            skip<uint32_t>(data); // frame size
+
+            offsets.reserve(frames + 1);
+            offsets.push_back({ 0, 0 });
+            for (uint32_t i = 0; i < frames; ++i) {
+                const auto compressed = ::read<uint32_t, std::endian::little>(data);
+                const auto decompressed = ::read<uint32_t, std::endian::little>(data);
+                skip<uint8_t>(data, entry_size - 8); // checksum
+                offsets.push_back({ offsets.back().compressed + compressed, offsets.back().decompressed + decompressed });
+                frame_size = std::max<size_t>(frame_size, decompressed);
+            }
+        }
+
+        const char* name() const override {
+            return "zstd";
+        }
+
+        uint64_t size() const override {
+            return offsets.back().decompressed;
+        }
+
+        size_t granularity() const override {
+            return std::max<size_t>(frame_size, 1);
+        }
+
+        bool read(uint64_t offset, uint8_t* buffer, size_t length) const override {
+            thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+            std::vector<uint8_t> compressed;
+            std::vector<uint8_t> frame;
+
+            // first frame that ends behind offset
+            auto it = std::upper_bound(offsets.begin(), offsets.end(), offset, [](uint64_t o, const frame_offset& f) {
+                return o < f.decompressed;
+            }) - 1;
+            while (length) {
+                const auto next = it + 1;
+                if (next == offsets.end()) {
+                    return false;
+                }
+                const auto frame_length = next->decompressed - it->decompressed;
+                const auto in_frame = offset - it->decompressed;
+                const auto n = std::min<uint64_t>(length, frame_length - in_frame);
+
+                compressed.resize(next->compressed - it->compressed);
+                if (!pread_all(fd, compressed.data(), compressed.size(), it->compressed)) {
+                    return false;
+                }
+                // whole frames go straight into the window
+                uint8_t* target = buffer;
+                if (in_frame != 0 || n != frame_length) {
+                    frame.resize(frame_length);
+                    target = frame.data();
+                }
+                const auto res = ZSTD_decompressDCtx(dctx.get(), target, frame_length, compressed.data(), compressed.size());
+                if (ZSTD_isError(res) || res != frame_length) {
+                    return false;
+                }
+                if (target != buffer) {
+                    std::memcpy(buffer, frame.data() + in_frame, n);
+                }
+
+                buffer += n;
+                offset += n;
+                length -= n;
+                it = next;
+            }
+            return true;
+        }
+
+    private:
+        struct frame_offset {
+            uint64_t compressed;
+            uint64_t decompressed;
+        };
+
+        int fd;
+        size_t frame_size = 0;
+        std::vector<frame_offset> offsets;
+    };
+#endif
+
+    // gzip has no random access, an index of restart points is built in one pass first
+    // based on https://github.com/madler/zlib/blob/develop/examples/zran.c
+    class gzip_input : public input {
+    public:
+        static constexpr size_t SPAN = 16 * 1024 * 1024;
+        static constexpr size_t WINDOW = 32 * 1024;
+        static constexpr size_t CHUNK = 64 * 1024;
+
+        explicit gzip_input(int fd) : fd(fd) {
+            fprintf(stderr, "building gzip index..\n");
+            if (!build()) {
+                fail("couldn't read gzip image");
+            }
+        }
+
+        const char* name() const override {
+            return "gzip";
+        }
+
+        uint64_t size() const override {
+            return total;
+        }
+
+        size_t granularity() const override {
+            return SPAN;
+        }
+
+        bool read(uint64_t offset, uint8_t* buffer, size_t length) const override {
+            auto it = std::upper_bound(points.begin(), points.end(), offset, [](uint64_t o, const point& p) {
+                return o < p.out;
+            }) - 1;
+
+            z_stream stream{};
+            uint64_t in = it->in;
+            bool raw = !it->member_start;
+            if (inflateInit2(&stream, raw ? -15 : 47) != Z_OK) {
+                return false;
+            }
+            uint8_t input[CHUNK];
+            if (raw) {
+                if (it->bits) {
+                    uint8_t ch;
+                    if (!pread_all(fd, &ch, 1, in - 1)) {
+                        inflateEnd(&stream);
+                        return false;
+                    }
+                    inflatePrime(&stream, it->bits, ch >> (8 - it->bits));
+                }
+                inflateSetDictionary(&stream, it->window.data(), it->window.size());
+            }
+
+            uint8_t discard[WINDOW];
+            uint64_t skip = offset - it->out;
+            bool ok = true;
+            while (length && ok) {
+                if (stream.avail_in == 0) {
+                    const auto res = pread(fd, input, sizeof(input), in);
+                    if (res <= 0) {
+                        ok = false;
+                        break;
+                    }
+                    in += res;
+                    stream.next_in = input;
+                    stream.avail_in = res;
+                }
+                if (skip) {
+                    stream.next_out = discard;
+                    stream.avail_out = std::min<uint64_t>(skip, sizeof(discard));
+                } else {
+                    stream.next_out = buffer;
+                    stream.avail_out = std::min<size_t>(length, 0x40000000);
+                }
+                const auto before = stream.avail_out;
+                const auto ret = inflate(&stream, Z_NO_FLUSH);
+                const auto n = before - stream.avail_out;
+                if (skip) {
+                    skip -= n;
+                } else {
+                    buffer += n;
+                    length -= n;
+                }
+                if (ret == Z_STREAM_END) {
+                    // next member, a raw stream still has the gzip trailer in front of it
+                    if (raw) {
+                        const auto trailer = std::min<size_t>(8, stream.avail_in);
+                        stream.next_in += trailer;
+                        stream.avail_in -= trailer;
+                        in += 8 - trailer;
+                        raw = false;
+                    }
+                    ok = inflateReset2(&stream, 47) == Z_OK;
+                } else if (ret != Z_OK && !(ret == Z_BUF_ERROR && (n || !stream.avail_in))) {
+                    ok = false;
+                }
+            }
+            inflateEnd(&stream);
+            return ok;
+        }
+
+    private:
+        struct point {
+            uint64_t out;
+            uint64_t in;
+            int bits;
+            bool member_start;
+            std::vector<uint8_t> window;
+        };
+
+        bool build() {
+            z_stream stream{};
+            if (inflateInit2(&stream, 47) != Z_OK) {
+                return false;
+            }
+            uint8_t input[CHUNK];
+            uint8_t window[WINDOW];
+            uint64_t in = 0;
+            uint64_t total_in = 0;
+            uint64_t total_out = 0;
+            uint64_t last = 0;
+            points.push_back({ 0, 0, 0, true, {} });
+
+            int ret = Z_OK;
+            while (true) {
+                if (stream.avail_in == 0) {
+                    const auto res = pread(fd, input, sizeof(input), in);
+                    if (res < 0) {
+                        break;
+                    }
+                    if (res == 0) {
+                        // end of file is only fine right after a member
+                        break;
+                    }
+                    in += res;
+                    stream.next_in = input;
+                    stream.avail_in = res;
+                }
+                if (stream.avail_out == 0) {
+                    stream.next_out = window;
+                    stream.avail_out = sizeof(window);
+                }
+                total_in += stream.avail_in;
+                total_out += stream.avail_out;
+                ret = inflate(&stream, Z_BLOCK);
+                total_in -= stream.avail_in;
+                total_out -= stream.avail_out;
+                if (ret == Z_STREAM_END) {
+                    // maybe another member follows
+                    if (stream.avail_in == 0 && pread(fd, input, 1, in) <= 0) {
+                        break;
+                    }
+                    if (inflateReset(&stream) != Z_OK) {
+                        break;
+                    }
+                    points.push_back({ total_out, total_in, 0, true, {} });
+                    last = total_out;
+                    continue;
+                }
+                if (ret != Z_OK && !(ret == Z_BUF_ERROR && !stream.avail_in)) {
+                    break;
+                }
+                // end of a deflate block that isn't the last one
+                if ((stream.data_type & 128) && !(stream.data_type & 64) && total_out - last > SPAN) {
+                    point p{ total_out, total_in, stream.data_type & 7, false, std::vector<uint8_t>(WINDOW) };
+                    // the window is a ring, newest bytes end at next_out
+                    const auto used = sizeof(window) - stream.avail_out;
+                    std::memcpy(p.window.data(), window + used, sizeof(window) - used);
+                    std::memcpy(p.window.data() + sizeof(window) - used, window, used);
+                    if (total_out < WINDOW) {
+                        // not a full window yet
+                        p.window.erase(p.window.begin(), p.window.begin() + (WINDOW - total_out));
+                    }
+                    points.push_back(std::move(p));
+                    last = total_out;
+                }
+            }
+            inflateEnd(&stream);
+            total = total_out;
+            return ret == Z_STREAM_END;
+        }
+
+        int fd;
+        uint64_t total = 0;
+        std::vector<point> points;
+    };
+}
+
+std::unique_ptr<input> open_input(int fd) {
+    uint8_t magic[4] = {};
+    pread_all(fd, magic, sizeof(magic), 0);
+    const auto signature = peek<uint32_t, std::endian::big>(std::span<const uint8_t>(magic));
+
+    if (signature == qcow2_input::MAGIC) {
+        return std::make_unique<qcow2_input>(fd);
+    }
+    if (magic[0] == 0x1F && magic[1] == 0x8B) {
+        return std::make_unique<gzip_input>(fd);
+    }
+    if (signature == 0x28B52FFD) {
+        // zstd frame
+#ifdef HAVE_ZSTD
+        if (zstd_seekable_input::detect(fd)) {
+            return std::make_unique<zstd_seekable_input>(fd);
+        }
+        fail("zstd image has no seek table, compress it with the seekable format");
+#else
+        fail("built without zstd support");
+#endif
+    }
+    return nullptr;
+}
+
+std::unique_ptr<input> open_raw_input(int fd, uint64_t size) {
+    return std::make_unique<raw_input>(fd, size);
+}
+
+input_windows::input_windows(const input& source, size_t step, size_t lookahead, worker_pool& pool) :
+    source(source),
+    pool(pool),
+    step(step),
+    chunks_per_window(1 + (lookahead + step - 1) / step)
+{
+    // one chunk more than a window, it is decompressed while the window is scanned
+    const auto slots = chunks_per_window + 1;
+    ring_size = slots * step;
+    pending.resize(slots);
+
+    auto fd = memfd_create("koku-recover-images", 0);
+    if (fd == -1 || ftruncate(fd, ring_size) == -1) {
+        fail("couldn't create the decompression buffer");
+    }
+    // reserve twice the size, then map the same memory into both halves
+    auto addr = mmap(nullptr, 2 * ring_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (
+        addr == MAP_FAILED ||
+        mmap(addr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(static_cast<uint8_t*>(addr) + ring_size, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+    ) {
+        fail("couldn't map the decompression buffer");
+    }
+    close(fd);
+    ring = static_cast<uint8_t*>(addr);
+    madvise(ring, 2 * ring_size, MADV_DONTDUMP);
+
+    for (size_t i = 0; i < slots; ++i) {
+        fill(i);
+    }
+}
+
+input_windows::~input_windows() {
+    for (auto& futures : pending) {
+        for (auto& f : futures) {
+            f.wait();
+        }
+    }
+    munmap(ring, 2 * ring_size);
+}
+
+void input_windows::fill(size_t chunk) {
+    const uint64_t begin = uint64_t(chunk) * step;
+    const uint64_t end = std::min<uint64_t>(begin + step, source.size());
+    ++filled;
+    auto& futures = pending[chunk % pending.size()];
+    futures.clear();
+    if (begin >= end) {
+        return;
+    }
+    // split along the natural unit of the input, so pieces don't share frames
+    const auto piece = std::max<size_t>(source.granularity(), 4 * 1024 * 1024);
+    const auto target = ring + (begin % ring_size);
+    for (auto offset = begin; offset < end;) {
+        const auto piece_end = std::min<uint64_t>(end, (offset / piece + 1) * piece);
+        futures.push_back(pool.submit([this, offset, piece_end, buffer = target + (offset - begin)] {
+            return source.read(offset, buffer, piece_end - offset);
+        }));
+        offset = piece_end;
+    }
+}
+
+void input_windows::wait(size_t chunk) {
+    for (auto& f : pending[chunk % pending.size()]) {
+        if (f.valid() && !f.get()) {
+            fail("couldn't decompress the disk image");
+        }
+    }
+}
+
+std::span<const uint8_t> input_windows::next(uint64_t& base) {
+    if (current > 0) {
+        // the previous window is done, reuse its first chunk
+        fill(filled);
+    }
+    base = uint64_t(current) * step;
+    if (base >= source.size()) {
+        return {};
+    }
+    for (size_t i = current; i < current + chunks_per_window; ++i) {
+        wait(i);
+    }
+    const auto length = std::min<uint64_t>(source.size() - base, chunks_per_window * step);
+    auto window = std::span<const uint8_t>(ring + (base % ring_size), length);
+    ++current;
+    return window;
+}
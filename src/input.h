@@ -0,0 +1,60 @@
+#ifndef H_INPUT
+#define H_INPUT
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <span>
+#include <vector>
+#include "worker_pool.h"
+
+// decompressed view of a compressed disk image
+class input {
+public:
+    virtual ~input() = default;
+    virtual const char* name() const = 0;
+    virtual uint64_t size() const = 0;
+    // thread safe, called from several workers at once
+    virtual bool read(uint64_t offset, uint8_t* buffer, size_t length) const = 0;
+    // reads are split along multiples of this, e.g. the size of a frame
+    virtual size_t granularity() const = 0;
+};
+
+// returns nullptr for a raw image, which is memory mapped instead
+// exits if the image is compressed but can't be read
+std::unique_ptr<input> open_input(int fd);
+// reads with pread, for code that wants an input no matter how the image is scanned
+std::unique_ptr<input> open_raw_input(int fd, uint64_t size);
+
+// slides a window over the decompressed input
+// the window is backed by a ring mapped twice in a row, so every window is contiguous
+// the chunks in front of the window are decompressed in parallel on the pool
+class input_windows {
+public:
+    input_windows(const input& source, size_t step, size_t lookahead, worker_pool& pool);
+    ~input_windows();
+
+    input_windows(const input_windows&) = delete;
+    input_windows& operator=(const input_windows&) = delete;
+
+    // the scan owns [0, step) of the window, the rest is lookahead for the parsers
+    // the previous window is overwritten, returns an empty span at the end
+    std::span<const uint8_t> next(uint64_t& base);
+
+private:
+    void fill(size_t chunk);
+    void wait(size_t chunk);
+
+    const input& source;
+    worker_pool& pool;
+    const size_t step;
+    const size_t chunks_per_window;
+    size_t ring_size = 0;
+    uint8_t* ring = nullptr;
+    size_t current = 0;  // first chunk of the next window
+    size_t filled = 0;   // chunks submitted
+    std::vector<std::vector<std::future<bool>>> pending;
+};
+
+#endif
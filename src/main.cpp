@@ -12,280 +12,844 @@
 #include <cstring>
 #include <bit>
 #include <format>
-#include <signal.h>
 #include <cstdint>
-#include <sys/sendfile.h>
+#include <deque>
+#include <future>
+#include <optional>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
-#include "read_jpg.h"
-#include "read_png.h"
-#include "read_tif.h"
-#include "read_gif.h"
-#include "read_webp.h"
+#include "parsers.h"
 #include "utils.h"
+#include "worker_pool.h"
+#include "prefetch.h"
+#include "output.h"
+#include "report.h"
+#include "input.h"
+#include "schedule.h"
+#include "allocation.h"
+#include "incremental.h"
+#include "classify.h"
+#include "unreadable.h"
+#include "recover_png.h"
+#include "recover_jpg.h"
+#include "decode_jpg.h"
 
 constexpr ssize_t MAX_SIZE = 1 * 1024 * 1024 * 1024; // 1GiB
+// size of the windows a decompressed input is scanned in
+constexpr size_t STEP = 64 * 1024 * 1024;
+// the progress of an input is published in steps of this
+constexpr uint64_t REPORT_STEP = 1024 * 1024;
+// candidates per thread of the pool the scan may run ahead of the oldest one
+constexpr size_t QUEUE_DEPTH = 16;
+// formats starting with a zero byte are only tried at the start of a sector, zeros are everywhere
+constexpr uint64_t SECTOR = 512;
+// how much of a memory mapped disk image is probed at once before it is read
+constexpr size_t PROBE_STEP = 1024 * 1024;
 
-bool update_print = true;
-bool alarm_running = false;
-void handle_alarm( int sig ) {
-    alarm_running = false;
-    update_print = true;
-}
+FILE* manifest = nullptr;
+// all inputs share one writer and manifest
+std::mutex writer;
 
-std::string format_bytes(size_t size, bool atty) {
-    double v = size;
-    const char* u = nullptr;
-    if (v < 1024 * 1024) {
-        v /= 1024;
-        u = "KiB";
-    } else if (v < 1024 * 1024 * 1024) {
-        v /= 1024 * 1024;
-        u = "MiB";
-    } else {
-        v /= 1024 * 1024 * 1024;
-        u = "GiB";
-    }
-    if (atty) {
-        return std::format("\33[1m{:7.2f}\33[0m{}", v, u);
-    }
-    return std::format("{:.2f}{}", v, u);
-}
+// options
+bool deep_png = false;
+bool strict_gif = false;
+size_t prefetch_distance = 64 * 1024 * 1024;
+size_t rss_cap = 0;
+// fragmented pngs and jpgs, only searched in memory mapped disk images
+bool fragmented = false;
+size_t fragment_budget = 1000; // ms per image
+size_t default_cluster = 4096; // where no filesystem tells the cluster size
+
+// filters, checked before an image is queued
+size_t min_pixels = 0;
+size_t min_bytes = 0;
+size_t max_bytes = MAX_SIZE;
 
-enum MODE {
-    COPY_FILE_RANGE,
-    SENDFILE,
-    WRITE
+// how far before a changed block an image may start and still run into it
+size_t reach = 64 * 1024 * 1024;
+// first bytes of the selected formats, the others never reach the dispatch
+std::array<bool, 256> is_first_byte = {};
+// ico, jp2 or jxl, which share the first byte 0x00
+bool sector_formats = false;
+bool selected[FORMAT_COUNT]; // --formats
+
+// a candidate parsed and checked on the pool
+struct candidate {
+    PARSE result = PARSE_FAILED;
+    std::span<const uint8_t> data; // the image once it is PARSE_DONE
+    image_info info;
+    bool valid = true;             // --deep-png or the decoder of a recoverable jpg agree
+    std::optional<parser> state;   // goes on in the next window of a decompressed input
+    uint64_t fed = 0;
+    bool unreadable = false;       // ran into a page of the disk image that can't be read
 };
 
-void save(int fd, int img_count, const uint8_t* start, const std::span<const uint8_t> data, const char* ext);
+// candidates are parsed and checked on the pool, results are still saved in offset order
+// except for images spanning windows of a decompressed input, those are saved once they end
+struct pending {
+    uint64_t offset;
+    std::span<const uint8_t> data;
+    FORMAT format;
+    image_info info;
+    std::optional<std::future<candidate>> parsed;
+    std::optional<std::future<std::optional<reassembled>>> rebuilt;
+    bool recoverable = false;      // searched for its fragments if it isn't an image in one piece
+};
+std::optional<worker_pool> pool;
+std::optional<worker_pool> decompress;
+// fragment searches run for up to --fragment-budget, a scan that helps on pool never picks one up
+std::optional<worker_pool> searches;
 
-bool atty_stderr = isatty(fileno(stderr));
-bool atty_stdout = isatty(fileno(stdout));
-MODE mode = COPY_FILE_RANGE;
-std::string last_print;
+// a candidate of a decompressed input that runs past the end of its window
+struct unfinished_image {
+    uint64_t offset;
+    parser state;
+    uint64_t fed; // bytes so far
+};
 
-int main(int argc, const char** argv) {
-    if (argc < 2) {
-        if (argc > 0) {
-            fprintf(stderr, "Usage: %s <disk-image>\n", argv[0]);
-        } else {
-            fprintf(stderr, "Usage: koku-recover-images <disk-image>\n");
-        }
-        fprintf(stderr, "Description:\n\tExtracts unfragmented JPEGs, PNGs, GIFs and TIFFs from <disk-image>\n");
-        exit(-1);
+// one disk image, scanned on the thread of its device
+struct job {
+    const char* path;
+    int fd;
+    uint64_t size;
+    std::unique_ptr<input> source; // nullptr when the image is memory mapped
+    std::string prefix;            // output directory of this input, empty if there is only one
+    std::vector<range> ranges;     // what is scanned, sorted by offset
+    std::deque<pending> queue;
+    size_t found = 0;
+    uint64_t reported = 0;         // offset up to which the scan is counted in counters.offset
+    std::vector<uint64_t> hashes;  // --incremental, stored once the scan is done
+    std::string hash_path;
+    std::vector<range> space;      // where the rest of a fragmented image is searched, ranges before --incremental
+    std::span<const uint8_t> disk; // the mapping, empty while the input isn't memory mapped
+    std::vector<unfinished_image> unfinished; // fed the next window of a decompressed input
+    std::vector<std::vector<range>> passes; // --priority, the ranges in the order they are scanned
+    std::unique_ptr<unreadable_map> unreadable; // of the mapping, nullptr while the input isn't memory mapped
+};
+
+void save(job& j, uint64_t offset, const std::span<const uint8_t> data, FORMAT format, const image_info& info, const std::vector<range>& fragments = {});
+
+// images with unknown dimensions pass --min-pixels
+bool wanted(uint64_t size, const image_info& info) {
+    if (size < min_bytes || size > max_bytes) {
+        return false;
     }
-    auto fd = open(argv[1], O_RDONLY);
-    if (fd == -1) {
-        fprintf(stderr, "couldn't open file %s\n", argv[1]);
-        exit(-1);
+    if (info.width && info.height && uint64_t(info.width) * info.height < min_pixels) {
+        return false;
     }
-    struct stat  sb;
-    fstat(fd, &sb);
-    auto addr = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (addr == MAP_FAILED) {
-        fprintf(stderr, "couldn't memory map file %s\n", argv[1]);
-        exit(-1);
+    return true;
+}
+
+// searches the pieces of a fragmented image on their own pool
+void recover(job& j, pending& item) {
+    const auto offset = item.offset;
+    const auto format = item.format;
+    item.rebuilt = searches->submit([&j, offset, format] {
+        const fragment_search search{ j.disk, j.space, uint32_t(default_cluster), std::chrono::steady_clock::now() + std::chrono::milliseconds(fragment_budget), j.unreadable.get() };
+        return format == PNG ? recover_png(search, offset) : recover_jpg(search, offset);
+    });
+}
+
+// saves finished items at the front, waits while more than keep are pending
+void commit(job& j, size_t keep) {
+    auto& queue = j.queue;
+    while (!queue.empty()) {
+        auto& item = queue.front();
+        if (item.parsed) {
+            if (queue.size() <= keep && item.parsed->wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                break;
+            }
+            // the scan would wait, parses the next candidates itself meanwhile
+            while (item.parsed->wait_for(std::chrono::seconds(0)) != std::future_status::ready && pool->help()) {
+            }
+            auto c = item.parsed->get();
+            item.parsed.reset();
+            if (c.state) {
+                // ran into the end of the window, goes on with the next one
+                j.unfinished.emplace_back(item.offset, std::move(*c.state), c.fed);
+                queue.pop_front();
+                continue;
+            }
+            if (c.result == PARSE_DONE) {
+                if (!wanted(c.data.size(), c.info)) {
+                    queue.pop_front();
+                    continue;
+                }
+                item.data = c.data;
+                item.info = c.info;
+                if (!c.valid) {
+                    if (item.recoverable && item.format == JPG) {
+                        // ends at a stray EOI or decodes into another file, may go on elsewhere
+                        recover(j, item);
+                        continue;
+                    }
+                    queue.pop_front();
+                    continue;
+                }
+            } else if (item.recoverable && !c.unreadable) {
+                // starts like an image but doesn't end in one piece
+                recover(j, item);
+                continue;
+            } else {
+                queue.pop_front();
+                continue;
+            }
+        }
+        if (item.rebuilt) {
+            if (queue.size() <= keep && item.rebuilt->wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                break;
+            }
+            const auto result = item.rebuilt->get();
+            if (result && wanted(result->data.size(), result->info)) {
+                save(j, item.offset, result->data, item.format, result->info, result->fragments);
+            } else if (item.data.empty()) {
+                // nothing to fall back to
+                queue.pop_front();
+                continue;
+            } else {
+                save(j, item.offset, item.data, item.format, item.info);
+            }
+        } else {
+            save(j, item.offset, item.data, item.format, item.info);
+        }
+        ++j.found;
+        counters.found.fetch_add(1, std::memory_order_relaxed);
+        counters.found_format[item.format].fetch_add(1, std::memory_order_relaxed);
+        queue.pop_front();
     }
-    madvise(addr, sb.st_size, MADV_DONTDUMP);
-    madvise(addr, sb.st_size, MADV_SEQUENTIAL);
-    auto span = std::span<const uint8_t>{(unsigned char*)addr, (size_t)sb.st_size};
+}
 
-    signal(SIGALRM, handle_alarm);
+// feeds a candidate of a window of a decompressed input
+// tif looks at it in place, follow() reads it again once the windows reach what it needs
+PARSE feed_window(parser& state, std::span<const uint8_t> data) {
+    if (const auto tif = std::get_if<tif_parser>(&state)) {
+        return tif->parse(data);
+    }
+    return feed(state, data);
+}
 
-    size_t found = 0;
-    size_t found_jpg = 0;
-    size_t found_png = 0;
-    size_t found_tif = 0;
-    size_t found_gif = 0;
-    size_t found_webp = 0;
+// feeds a candidate of the memory mapped disk image, every piece is probed before the parser reads it
+PARSE feed_readable(parser& state, std::span<const uint8_t> data, unreadable_map& unreadable, bool& touched) {
+    if (const auto tif = std::get_if<tif_parser>(&state)) {
+        // fed piece by piece tif would copy all of it, so it looks at a growing readable front in place
+        size_t n = 0;
+        while (true) {
+            const auto want = std::min<uint64_t>(data.size(), std::max<uint64_t>({ tif->needs(), 2 * n, PROBE_STEP }));
+            n += unreadable.readable(data.subspan(n, want - n));
+            const auto result = tif->parse(data.first(n));
+            if (result != PARSE_MORE) {
+                return result;
+            }
+            if (n < want) {
+                touched = true;
+                return PARSE_FAILED;
+            }
+            if (n == data.size()) {
+                return result;
+            }
+        }
+    }
+    while (true) {
+        const auto piece = subspan(data, 0, PROBE_STEP);
+        const auto n = unreadable.readable(piece);
+        const auto result = feed(state, piece.first(n));
+        if (result != PARSE_MORE) {
+            return result;
+        }
+        if (n < piece.size()) {
+            touched = true;
+            return PARSE_FAILED;
+        }
+        data = data.subspan(n);
+        if (data.empty()) {
+            return PARSE_MORE;
+        }
+    }
+}
 
-    const auto start = span.data();
-    auto last = start;
-    const auto pagesize = getpagesize();
+// tries the offsets from, from + align, .. up to limit of window, the parsers may look up to the end of it
+// base is the offset of the window in the disk image
+void scan(job& j, std::span<const uint8_t> window, size_t from, size_t limit, size_t align, uint64_t base, prefetcher* prefetch) {
+    auto span = subspan(window, from);
+    const auto start = window.data();
+    j.reported = base + from;
+    // the scan reads nothing past this, the mapping is probed up to it
+    size_t readable = j.unreadable ? from : window.size();
 
     while (true) {
-        if (std::distance(last, span.data()) >= MAX_SIZE) {
-            // memory manage a little..
-            const auto source = (void*)(uintptr_t(last) / pagesize * pagesize);
-            const auto size = uintptr_t(span.data()) / pagesize * pagesize - uintptr_t(source);
-            madvise(source, size, MADV_DONTNEED);
-            last = decltype(last)(uintptr_t(source) + size);
-            madvise((void*)last, (2 * MAX_SIZE) / pagesize * pagesize, MADV_WILLNEED);
-        }
-
-        if (atty_stderr && (update_print || span.empty())) {
-            update_print = false;
-            const auto offset = std::distance(start, span.data());
-            const auto percent = offset / double(sb.st_size) * 100;
-            const auto pos = format_bytes(offset, atty_stderr);
-            const auto pos_max = format_bytes(sb.st_size, atty_stderr);
-            last_print = std::format("\33[2K\r\33[1m{:6.2f}\33[0m% {}/{} \33[1m{:11d}\33[0m images", percent, pos, pos_max, found);
-            fprintf(stderr, "%s", last_print.c_str());
-            fflush(stderr);
-            if (!alarm_running) {
-                alarm_running = true;
-                alarm(1);
-            }
+        const size_t position = std::distance(start, span.data());
+        if (prefetch) {
+            prefetch->advance(position);
+        }
+        if (base + position - j.reported >= REPORT_STEP && position < limit) {
+            counters.offset.fetch_add(base + position - j.reported, std::memory_order_relaxed);
+            j.reported = base + position;
         }
 
-        if (span.empty()) {
+        if (position >= limit) {
             break;
         }
 
+        if (position >= readable) {
+            const auto n = j.unreadable->readable(subspan(window, position, PROBE_STEP));
+            if (n == 0) {
+                // goes on after the hole, on the grid of the range
+                const auto to = j.unreadable->skip(position, limit);
+                span = subspan(window, from + (to - from + align - 1) / align * align);
+                continue;
+            }
+            readable = position + n;
+        }
+
         // quick skip
-        {
-            constexpr auto FIRST_BYTES = std::array{
-                FIRST_BYTE_JPG,
-                FIRST_BYTE_PNG,
-                FIRST_BYTE_GIF,
-                FIRST_BYTE_TIF_LITTLE,
-                FIRST_BYTE_TIF_BIG,
-                FIRST_BYTE_WEBP
-            };
-            auto tmp = subspan(span, 0, MAX_SIZE);
-            span = span.subspan(std::distance(tmp.begin(), std::find_first_of(tmp.begin(), tmp.end(), FIRST_BYTES.begin(), FIRST_BYTES.end())));
-            if (span.empty()) {
+        if (align > 1) {
+            // images start at a cluster
+            if (!is_first_byte[span[0]] && !(sector_formats && span[0] == 0)) {
+                span = subspan(span, align);
                 continue;
             }
+        } else {
+            const auto sector = (base + position) % SECTOR;
+            if (!(sector_formats && sector == 0 && span[0] == 0)) {
+                auto tmp = subspan(span, 0, std::min<size_t>({ MAX_SIZE, limit - position, readable - position }));
+                if (sector_formats) {
+                    // up to the start of the next sector
+                    tmp = subspan(tmp, 0, SECTOR - sector);
+                }
+                span = span.subspan(std::distance(tmp.begin(), std::find_if(tmp.begin(), tmp.end(), [](uint8_t b) { return is_first_byte[b]; })));
+                if (span.data() == tmp.data() + tmp.size()) {
+                    continue;
+                }
+            }
         }
 
-        decltype(span) img_data = subspan(span, 0, MAX_SIZE);
-        const char* ext = nullptr;
-        size_t* found_ext;
-        switch (span[0]) {
-            case FIRST_BYTE_JPG:
-                img_data = read_jpg(img_data);
-                ext = "jpg";
-                found_ext = &found_jpg;
-                break;
-            case FIRST_BYTE_PNG:
-                img_data = read_png(img_data);
-                ext = "png";
-                found_ext = &found_png;
-                break;
-            case FIRST_BYTE_TIF_BIG:
-            case FIRST_BYTE_TIF_LITTLE:
-                img_data = read_tif(img_data);
-                ext = "tif";
-                found_ext = &found_tif;
-                break;
-            case FIRST_BYTE_GIF:
-                img_data = read_gif(img_data);
-                ext = "gif";
-                found_ext = &found_gif;
-                break;
-            case FIRST_BYTE_WEBP:
-                img_data = read_webp(img_data);
-                ext = "webp";
-                found_ext = &found_webp;
-                break;
+        counters.candidates.fetch_add(1, std::memory_order_relaxed);
+        parser state;
+        if (open_parser(state, subspan(span, 0, readable - position), strict_gif, max_bytes) && selected[format_of(state)]) {
+            const uint64_t offset = base + std::distance(start, span.data());
+            const auto format = format_of(state);
+            auto& item = j.queue.emplace_back(offset, std::span<const uint8_t>{}, format, image_info{});
+            // only files starting on a cluster can be fragmented
+            item.recoverable = fragmented && !j.disk.empty() && (align > 1 || offset % default_cluster == 0) && (
+                (format == PNG && span.size() >= 8 && memcmp(span.data(), "\x89PNG\r\n\x1a\n", 8) == 0) ||
+                (format == JPG && span.size() >= 3 && span[1] == 0xD8 && span[2] == 0xFF)
+            );
+            const bool resumable = j.source && span.size() < max_bytes && base + window.size() < j.size;
+            const bool decode = item.recoverable && format == JPG;
+            const auto unreadable = j.unreadable.get();
+            item.parsed = pool->submit([state = std::move(state), data = subspan(span, 0, max_bytes), format, resumable, decode, unreadable]() mutable {
+                candidate c;
+                c.result = unreadable ? feed_readable(state, data, *unreadable, c.unreadable) : feed_window(state, data);
+                if (c.result == PARSE_DONE) {
+                    c.data = data.first(size_of(state));
+                    c.info = info_of(state);
+                    if (!wanted(c.data.size(), c.info)) {
+                        return c;
+                    }
+                    if (deep_png && format == PNG) {
+                        c.valid = check_png_data(c.data);
+                    }
+                    if (decode) {
+                        c.valid = check_jpg_data(c.data);
+                    }
+                } else if (c.result == PARSE_MORE && resumable) {
+                    c.state = std::move(state);
+                    c.fed = data.size();
+                }
+                return c;
+            });
+            commit(j, QUEUE_DEPTH * pool->size());
+        }
+
+        span = subspan(span, align);
+    }
+    counters.offset.fetch_add(base + limit - j.reported, std::memory_order_relaxed);
+}
+
+// feeds the next window of a decompressed input to the unfinished candidates
+// the windows an image spans are gone once it ends, so it is read again from the input
+void follow(job& j, std::span<const uint8_t> window) {
+    std::erase_if(j.unfinished, [&](unfinished_image& u) {
+        const auto data = subspan(window, 0, max_bytes - u.fed);
+        u.fed += data.size();
+        auto result = PARSE_MORE;
+        std::vector<uint8_t> kept;
+        if (const auto tif = std::get_if<tif_parser>(&u.state)) {
+            // fed window by window tif would keep all of them, it waits for the length it needs instead
+            while (result == PARSE_MORE && tif->needs() <= u.fed) {
+                kept.resize(tif->needs());
+                if (!j.source->read(u.offset, kept.data(), kept.size())) {
+                    return true;
+                }
+                result = tif->parse(kept);
+            }
+        } else {
+            result = feed(u.state, data);
         }
-        if (ext && !img_data.empty()) {
-            update_print = true;
-            save(fd, found, start, img_data, ext);
-            ++found;
-            ++(*found_ext);
+        if (result == PARSE_MORE) {
+            // the last window drops the rest
+            return u.fed >= max_bytes;
         }
+        const auto size = size_of(u.state);
+        const auto format = format_of(u.state);
+        const auto info = info_of(u.state);
+        if (result == PARSE_FAILED || !wanted(size, info)) {
+            return true;
+        }
+        auto& item = j.queue.emplace_back(u.offset, std::span<const uint8_t>{}, format, info);
+        if (!kept.empty()) {
+            kept.resize(size);
+            item.rebuilt = decompress->submit([data = std::move(kept), info]() mutable -> std::optional<reassembled> {
+                return reassembled{ std::move(data), {}, info };
+            });
+            return true;
+        }
+        item.rebuilt = decompress->submit([&j, offset = u.offset, size, format, info]() -> std::optional<reassembled> {
+            reassembled image;
+            image.data.resize(size);
+            image.info = info;
+            if (!j.source->read(offset, image.data.data(), size)) {
+                return {};
+            }
+            if (deep_png && format == PNG && !check_png_data(image.data)) {
+                return {};
+            }
+            return image;
+        });
+        return true;
+    });
+}
 
-        span = subspan(span, sizeof(unsigned char));
+void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [options] <disk-image>...\n", name);
+    fprintf(stderr, "Description:\n\tExtracts unfragmented JPEGs, PNGs, GIFs, TIFFs, WEBPs, BMPs, icons, PSDs, JPEG 2000s and JPEG XLs from every <disk-image>\n");
+    fprintf(stderr, "\tdisk images on different disks are scanned in parallel, the rest one after another\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "\t--deep-png\tinflate the image data of PNGs and check it against IHDR\n");
+    fprintf(stderr, "\t--strict-gif\tcheck the LZW data and frame rectangles of GIFs\n");
+    fprintf(stderr, "\t--prefetch=<MiB>\tminimum distance the prefetcher stays ahead of the scan (default 64)\n");
+    fprintf(stderr, "\t--rss-cap=<MiB>\tlimit of the input pages kept resident (default unlimited)\n");
+    fprintf(stderr, "\t--tar\twrite all images into images.NNNN.tar instead of one file each\n");
+    fprintf(stderr, "\t--tar-split=<MiB>\tstart a new archive once one grows past this size (default never)\n");
+    fprintf(stderr, "\t--reflink\tshare the data with <disk-image> instead of copying it (btrfs, XFS)\n");
+    fprintf(stderr, "\t--raw\tdon't detect compressed images (qcow2, seekable zstd, gzip)\n");
+    fprintf(stderr, "\t--unallocated\tonly scan the free clusters of the filesystems (ext2/3/4, NTFS, FAT, exFAT)\n");
+    fprintf(stderr, "\t--incremental\tonly rescan the blocks that changed since the last run in this folder\n");
+    fprintf(stderr, "\t--priority\tscan the regions that look like they hold images first, writes heatmap.tsv (uncompressed disk images only)\n");
+    fprintf(stderr, "\t--reach=<MiB>\thow far before a changed block images are scanned again (default 64)\n");
+    fprintf(stderr, "\t--formats=<list>\tonly look for these formats, e.g. jpg,png (default jpg,png,tif,gif,webp,bmp,ico,psd,jp2,jxl)\n");
+    fprintf(stderr, "\t--min-pixels=<n>\tskip images with less than n pixels (width * height)\n");
+    fprintf(stderr, "\t--min-bytes=<n>\tskip images smaller than n bytes\n");
+    fprintf(stderr, "\t--max-bytes=<n>\tskip images larger than n bytes\n");
+    fprintf(stderr, "\t--fragmented\treassemble PNGs and JPEGs that broke at cluster boundaries (uncompressed disk images only)\n");
+    fprintf(stderr, "\t--fragment-budget=<ms>\ttime the search for the pieces of one image may take (default 1000)\n");
+    fprintf(stderr, "\t--cluster=<n>\tcluster size outside of known filesystems, images only break at its multiples (default 4096)\n");
+    exit(-1);
+}
+
+// parses the value of --name=<n>
+bool parse_number(std::string_view arg, std::string_view name, size_t& value) {
+    if (!arg.starts_with(name) || arg.size() <= name.size() || arg[name.size()] != '=') {
+        return false;
+    }
+    char* end = nullptr;
+    const auto str = arg.data() + name.size() + 1;
+    const auto n = strtoull(str, &end, 10);
+    if (end == str || *end != '\0') {
+        return false;
     }
+    value = n;
+    return true;
+}
 
-    munmap(addr, sb.st_size);
-    close(fd);
-    fprintf(stderr, "\n");
+// parses the value of --name=<MiB>
+bool parse_mib(std::string_view arg, std::string_view name, size_t& value) {
+    if (!parse_number(arg, name, value)) {
+        return false;
+    }
+    value *= 1024 * 1024;
+    return true;
+}
 
-    exit(0);
+// parses --formats=jpg,png,..
+bool parse_formats(std::string_view arg, bool (&selected)[FORMAT_COUNT]) {
+    constexpr std::string_view name = "--formats=";
+    if (!arg.starts_with(name)) {
+        return false;
+    }
+    std::fill(std::begin(selected), std::end(selected), false);
+    arg.remove_prefix(name.size());
+    while (!arg.empty()) {
+        const auto item = arg.substr(0, arg.find(','));
+        arg.remove_prefix(std::min(arg.size(), item.size() + 1));
+        const auto it = std::find(std::begin(FORMAT_NAMES), std::end(FORMAT_NAMES), item);
+        if (it == std::end(FORMAT_NAMES)) {
+            return false;
+        }
+        selected[std::distance(std::begin(FORMAT_NAMES), it)] = true;
+    }
+    return std::find(std::begin(selected), std::end(selected), true) != std::end(selected);
 }
 
-void save(int fd, int img_count, const uint8_t* start, const std::span<const uint8_t> data, const char* ext) {
-    // save the data
-    auto offset = std::distance(start, data.data());
-
-    auto dir = std::format("{:08d}", img_count / 4096);
-    auto name = std::format("{}/{:020d}.{}", dir, offset, ext);
-
-    if (atty_stdout) {
-        if (atty_stderr) {
-            fprintf(stderr, "\33[2K\r");
-            fflush(stderr);
-        }
-        fprintf(stdout, "%-34s", name.c_str());
-        if (atty_stderr) {
-            auto size = format_bytes(data.size(), atty_stdout);
-            fflush(stdout);
-            fprintf(stderr, " %s\n%s", size.c_str(), last_print.c_str());
-            fflush(stderr);
-        } else {
-            fprintf(stdout, "\n");
+// limits the scan to the blocks that changed since the last run, see --incremental
+// results of the last run that are scanned again are deleted, returns how many were kept
+size_t rescan(job& j, const std::vector<uint64_t>& before, const std::vector<manifest_entry>& previous, std::vector<bool>& dropped, bool single) {
+    const auto belongs = [&](const manifest_entry& e) {
+        return e.input == j.path || (e.input.empty() && single);
+    };
+    const auto find = [](const std::vector<range>& ranges, uint64_t offset) {
+        return std::upper_bound(ranges.begin(), ranges.end(), offset, [](uint64_t o, const range& r) { return o < r.end(); });
+    };
+
+    std::vector<range> changed;
+    std::vector<range> again = { { 0, j.size } };
+    if (!before.empty()) {
+        changed = changed_blocks(before, j.hashes, j.size);
+        again.clear();
+        for (const auto& c : changed) {
+            const auto from = c.offset - std::min<uint64_t>(c.offset, reach);
+            again.push_back({ from, c.end() - from });
+        }
+        // results reaching further than the window still get their start scanned again
+        for (const auto& e : previous) {
+            if (!belongs(e)) {
+                continue;
+            }
+            const auto c = find(changed, e.offset);
+            if (c != changed.end() && c->offset < e.offset + e.size) {
+                again.push_back({ e.offset, 1 });
+            }
         }
-    } else {
-        fprintf(stdout, "%s\n", name.c_str());
+        again = merge(again);
     }
+    j.ranges = intersect(j.ranges, again);
 
-    mkdir(dir.c_str(), 0750);
-    auto fd_jpg = open(name.c_str(), O_WRONLY|O_CREAT, 0640);
-    if (fd_jpg == -1) {
-        if (atty_stderr) {
-            fprintf(stderr, "\33[2K\r");
+    size_t kept = 0;
+    for (size_t i = 0; i < previous.size(); ++i) {
+        const auto& e = previous[i];
+        if (!belongs(e)) {
+            continue;
+        }
+        const auto r = find(again, e.offset);
+        if ((r != again.end() && r->offset <= e.offset) || e.offset + e.size > j.size) {
+            dropped[i] = true;
+            unlink(e.name.c_str());
+        } else {
+            ++kept;
         }
-        fprintf(stderr, "couldn't create new file %s\n", name.c_str());
-        exit(-1);
     }
+    uint64_t length = 0;
+    for (const auto& c : changed) {
+        length += c.length;
+    }
+    fprintf(stderr, "%s: %s changed, %zu results kept\n", j.path, format_bytes(before.empty() ? j.size : length, false).c_str(), kept);
+    return kept;
+}
 
-    if (mode == COPY_FILE_RANGE) {
-        loff_t off_in  = offset;
-        loff_t off_out = 0;
-        while (true) {
-            ssize_t size = data.size() - off_out;
-            auto res = copy_file_range(fd, &off_in, fd_jpg, &off_out, size, 0);
-            if (res == 0 || res == size) {
-                break;
+// lists the holes the scan went around in the manifest, there is no image at them
+void log_unreadable(job& j) {
+    const auto holes = j.unreadable->ranges();
+    if (holes.empty()) {
+        return;
+    }
+    uint64_t length = 0;
+    std::lock_guard lock(writer);
+    for (const auto& h : holes) {
+        fprintf(manifest, "\t%lu\t%lu\tunreadable\t0\t0\t\t0\t\t0\t%s\t\n", h.offset, h.length, j.path);
+        length += h.length;
+    }
+    fprintf(stderr, "%s: %s in %zu ranges couldn't be read, listed as unreadable in manifest.tsv\n", j.path, format_bytes(length, false).c_str(), holes.size());
+}
+
+void run(job& j) {
+    if (j.source) {
+        // decompressed into a ring of windows, candidates running past the end of one are fed the next ones
+        input_windows windows(*j.source, STEP, 0, *decompress);
+        uint64_t base = 0;
+        size_t first = 0;
+        for (auto window = windows.next(base); !window.empty(); window = windows.next(base)) {
+            const auto end = base + std::min(STEP, window.size());
+            follow(j, window);
+            while (first < j.ranges.size() && j.ranges[first].end() <= base) {
+                ++first;
             }
-            if (res == -1) {
-                mode = SENDFILE;
-                lseek(fd_jpg, 0, SEEK_SET);
-                break;
+            for (auto r = j.ranges.begin() + first; r != j.ranges.end() && r->offset < end; ++r) {
+                // the part of the range in this window, still on its cluster grid
+                const auto skipped = base > r->offset ? base - r->offset : 0;
+                const auto from = r->offset + (skipped + r->alignment - 1) / r->alignment * r->alignment;
+                const auto to = std::min(r->end(), end);
+                if (from < to) {
+                    scan(j, window, from - base, to - base, r->alignment, base, nullptr);
+                }
             }
+            // the next window overwrites the memory pending items point to
+            commit(j, 0);
+        }
+        // ran past the end of the input
+        j.unfinished.clear();
+    } else if (j.size) {
+        auto addr = mmap(nullptr, j.size, PROT_READ, MAP_PRIVATE, j.fd, 0);
+        if (addr == MAP_FAILED) {
+            fprintf(stderr, "couldn't memory map file %s\n", j.path);
+            exit(-1);
         }
+
+        madvise(addr, j.size, MADV_DONTDUMP);
+        madvise(addr, j.size, MADV_SEQUENTIAL);
+        auto span = std::span<const uint8_t>{(unsigned char*)addr, (size_t)j.size};
+        j.disk = span;
+        j.unreadable = std::make_unique<unreadable_map>(j.fd, span);
+
+        // every pass goes from the start to the end of the disk image once, as the prefetcher expects
+        const auto passes = j.passes.empty() ? std::vector<std::vector<range>>{ j.ranges } : j.passes;
+        std::optional<prefetcher> prefetch;
+        for (const auto& pass : passes) {
+            prefetch.emplace(j.fd, span.data(), span.size(), prefetch_distance, rss_cap, pass);
+            for (const auto& r : pass) {
+                scan(j, span, r.offset, r.end(), r.alignment, 0, &*prefetch);
+            }
+        }
+        commit(j, 0);
+        prefetch.reset();
+        log_unreadable(j);
+        j.unreadable.reset();
+        j.disk = {};
+        munmap(addr, j.size);
     }
-    if (mode == SENDFILE) {
-        loff_t off_in  = offset;
-        loff_t off_out = 0;
-        while (true) {
-            ssize_t size = data.size() - off_out;
-            auto res = sendfile(fd_jpg, fd, &off_in, size);
-            if (res == 0 || res == size) {
-                // man page doesn't mention in_fd eof case as in copy_file_range
-                // but it looks like it might return 0
-                // but it should never occur
-                break;
+    j.source.reset();
+    close(j.fd);
+}
+
+int main(int argc, const char** argv) {
+    const char* name = argc > 0 ? argv[0] : "koku-recover-images";
+    std::vector<const char*> paths;
+    OUTPUT output = FILES;
+    size_t tar_split = 0;
+    bool reflink = false;
+    bool raw = false;
+    bool only_unallocated = false;
+    bool incremental = false;
+    bool priority = false;
+    std::fill(std::begin(selected), std::end(selected), true);
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--deep-png") {
+            deep_png = true;
+        } else if (arg == "--strict-gif") {
+            strict_gif = true;
+        } else if (parse_mib(arg, "--prefetch", prefetch_distance)) {
+        } else if (parse_mib(arg, "--rss-cap", rss_cap)) {
+        } else if (arg == "--tar") {
+            output = TAR;
+        } else if (parse_mib(arg, "--tar-split", tar_split)) {
+        } else if (arg == "--reflink") {
+            reflink = true;
+        } else if (arg == "--raw") {
+            raw = true;
+        } else if (arg == "--unallocated") {
+            only_unallocated = true;
+        } else if (arg == "--incremental") {
+            incremental = true;
+        } else if (arg == "--priority") {
+            priority = true;
+        } else if (parse_mib(arg, "--reach", reach)) {
+        } else if (arg.starts_with("--formats")) {
+            if (!parse_formats(arg, selected)) {
+                usage(name);
             }
-            if (res == -1) {
-                mode = WRITE;
-                lseek(fd_jpg, 0, SEEK_SET);
-                break;
+        } else if (parse_number(arg, "--min-pixels", min_pixels)) {
+        } else if (parse_number(arg, "--min-bytes", min_bytes)) {
+        } else if (parse_number(arg, "--max-bytes", max_bytes)) {
+        } else if (arg == "--fragmented") {
+            fragmented = true;
+        } else if (parse_number(arg, "--fragment-budget", fragment_budget)) {
+        } else if (parse_number(arg, "--cluster", default_cluster)) {
+            if (default_cluster == 0) {
+                usage(name);
             }
-            off_out += res;
+        } else if (arg.starts_with("--")) {
+            usage(name);
+        } else {
+            paths.push_back(argv[i]);
         }
     }
-    if (mode == WRITE) {
-        loff_t off_out = 0;
-        while (true) {
-            ssize_t size = data.size() - off_out;
-            auto res = write(fd_jpg, data.data() + off_out, size);
-            if (res == size) {
-                break;
-            }
-            if (res == -1) {
-                unlink(name.c_str());
-                if (atty_stderr) {
-                    fprintf(stderr, "\33[2K\r");
-                }
-                fprintf(stderr, "couldn't write to file %s\n", name.c_str());
-                exit(-1);
+    if (paths.empty()) {
+        usage(name);
+    }
+
+    if (selected[JPG]) {
+        is_first_byte[FIRST_BYTE_JPG] = true;
+    }
+    if (selected[PNG]) {
+        is_first_byte[FIRST_BYTE_PNG] = true;
+    }
+    if (selected[GIF]) {
+        is_first_byte[FIRST_BYTE_GIF] = true;
+    }
+    if (selected[TIF]) {
+        is_first_byte[FIRST_BYTE_TIF_LITTLE] = true;
+        is_first_byte[FIRST_BYTE_TIF_BIG] = true;
+    }
+    if (selected[WEBP]) {
+        is_first_byte[FIRST_BYTE_WEBP] = true;
+    }
+    if (selected[BMP]) {
+        is_first_byte[FIRST_BYTE_BMP] = true;
+    }
+    if (selected[PSD]) {
+        is_first_byte[FIRST_BYTE_PSD] = true;
+    }
+    sector_formats = selected[ICO] || selected[JP2] || selected[JXL];
+
+    // results of the last run, the ones that are scanned again are dropped
+    std::vector<manifest_entry> previous;
+    std::vector<bool> dropped;
+    bool has_previous = false;
+    std::optional<worker_pool> hashing;
+    if (incremental) {
+        if (output == TAR) {
+            fprintf(stderr, "--incremental can't update tar archives\n");
+            exit(-1);
+        }
+        has_previous = access("manifest.tsv", F_OK) == 0;
+        previous = read_manifest("manifest.tsv");
+        dropped.resize(previous.size());
+        hashing.emplace();
+    }
+    std::optional<worker_pool> sampling;
+    if (priority) {
+        sampling.emplace();
+    }
+
+    std::vector<job> jobs;
+    std::vector<struct stat> stats;
+    uint64_t total = 0;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        const auto path = paths[i];
+        auto fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "couldn't open file %s\n", path);
+            exit(-1);
+        }
+        struct stat sb;
+        fstat(fd, &sb);
+        uint64_t size = sb.st_size;
+        if (S_ISBLK(sb.st_mode)) {
+            size = lseek(fd, 0, SEEK_END);
+        }
+        std::unique_ptr<input> source;
+        if (!raw) {
+            source = open_input(fd);
+        }
+        if (source) {
+            size = source->size();
+        }
+        std::vector<range> ranges = { { 0, size } };
+        if (only_unallocated) {
+            ranges = unallocated(source ? *source : *open_raw_input(fd, size), path);
+        }
+        auto prefix = paths.size() > 1 ? std::format("{:03d}/", i) : std::string();
+        auto& j = jobs.emplace_back(path, fd, size, std::move(source), std::move(prefix), std::move(ranges));
+        j.space = j.ranges;
+        stats.push_back(sb);
+
+        if (incremental) {
+            fprintf(stderr, "%s: hashing..\n", path);
+            j.hash_path = paths.size() > 1 ? std::format("blocks.{:03d}.hash", i) : "blocks.hash";
+            j.hashes = hash_blocks(j.source ? *j.source : *open_raw_input(fd, size), *hashing);
+            const auto before = has_previous ? load_hashes(j.hash_path) : std::vector<uint64_t>{};
+            j.found = rescan(j, before, previous, dropped, paths.size() == 1);
+        }
+        if (priority && !j.source) {
+            fprintf(stderr, "%s: classifying..\n", path);
+            const auto regions = classify(*open_raw_input(fd, size), j.ranges, *sampling, [](std::span<const uint8_t> data) {
+                return is_first_byte[data[0]] && starts_image(data);
+            });
+            store_heatmap(paths.size() > 1 ? std::format("heatmap.{:03d}.tsv", i) : "heatmap.tsv", regions);
+            j.passes = prioritize(j.ranges, regions);
+        }
+        for (const auto& r : j.ranges) {
+            total += r.length;
+        }
+    }
+
+    manifest = fopen("manifest.tsv", "w");
+    if (!manifest) {
+        fprintf(stderr, "couldn't create manifest.tsv\n");
+        exit(-1);
+    }
+    fprintf(manifest, "name\toffset\tsize\tformat\twidth\theight\tvariant\tparts\tarchive\tarchive_offset\tinput\tfragments\n");
+    for (size_t i = 0; i < previous.size(); ++i) {
+        if (!dropped[i]) {
+            fprintf(manifest, "%s\n", previous[i].line.c_str());
+        }
+    }
+    hashing.reset();
+    sampling.reset();
+    output_open(output, tar_split, reflink);
+    report_start(total);
+
+    pool.emplace();
+    if (std::any_of(jobs.begin(), jobs.end(), [](const job& j) { return j.source != nullptr; })) {
+        decompress.emplace();
+    }
+    if (fragmented) {
+        searches.emplace();
+    }
+
+    // one thread per disk, the inputs on a disk don't compete for its queue
+    std::vector<std::thread> threads;
+    for (const auto& group : group_by_device(stats)) {
+        threads.emplace_back([&jobs, group] {
+            for (auto i : group) {
+                run(jobs[i]);
             }
-            off_out += res;
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    pool.reset();
+    decompress.reset();
+    searches.reset();
+    output_close();
+    fclose(manifest);
+    for (const auto& j : jobs) {
+        if (!j.hash_path.empty()) {
+            store_hashes(j.hash_path, j.hashes);
         }
     }
-    close(fd_jpg);
-}
\ No newline at end of file
+    report_stop();
+    if (reflink) {
+        const auto stats = output_statistics();
+        const bool atty = isatty(fileno(stderr));
+        fprintf(stderr, "shared %s, copied %s\n", format_bytes(stats.shared, atty).c_str(), format_bytes(stats.copied, atty).c_str());
+    }
+
+    exit(0);
+}
+
+void save(job& j, uint64_t offset, const std::span<const uint8_t> data, FORMAT format, const image_info& info, const std::vector<range>& fragments) {
+    // save the data
+    auto dir = std::format("{}{:08d}", j.prefix, j.found / 4096);
+    auto name = std::format("{}/{:020d}.{}", dir, offset, FORMAT_NAMES[format]);
+
+    std::lock_guard lock(writer);
+    report_image(name, data.size());
+
+    // a reassembled image only exists in memory
+    auto location = output_write(j.source || !fragments.empty() ? -1 : j.fd, offset, data, dir, name);
+
+    // offset+length of every piece, in order
+    std::string pieces;
+    for (const auto& f : fragments) {
+        pieces += std::format("{}{}+{}", pieces.empty() ? "" : ",", f.offset, f.length);
+    }
+    fprintf(manifest, "%s\t%lu\t%zu\t%s\t%u\t%u\t%s\t%u\t%s\t%lu\t%s\t%s\n", name.c_str(), offset, data.size(), FORMAT_NAMES[format], info.width, info.height, info.variant ? info.variant : "", info.parts, location.archive.c_str(), location.offset, j.path, pieces.c_str());
+}
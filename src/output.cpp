@@ -0,0 +1,341 @@
+#include "output.h"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <format>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+    enum MODE {
+        COPY_FILE_RANGE,
+        SENDFILE,
+        WRITE
+    };
+
+    OUTPUT type = FILES;
+    MODE mode = COPY_FILE_RANGE;
+
+    // REFLINK
+    bool reflink = false;
+    size_t clone_block = 0;
+    output_stats stats;
+
+    // FILES
+    std::string last_dir;
+
+    // TAR
+    size_t split = 0;
+    int archive_fd = -1;
+    int archive_index = -1;
+    uint64_t archive_offset = 0;
+    std::string archive_name;
+
+    constexpr size_t BLOCK = 512;
+
+    [[noreturn]] void fail(const std::string& message) {
+        if (isatty(fileno(stderr))) {
+            fprintf(stderr, "\33[2K\r");
+        }
+        fprintf(stderr, "%s\n", message.c_str());
+        exit(-1);
+    }
+
+    bool write_all(int fd_out, loff_t off_out, const uint8_t* data, size_t size) {
+        while (size) {
+            auto res = pwrite(fd_out, data, size, off_out);
+            if (res == -1) {
+                return false;
+            }
+            data += res;
+            size -= res;
+            off_out += res;
+        }
+        return true;
+    }
+
+    // copies data (found at off_in in fd_in) to off_out in fd_out
+    // tries to keep the bytes inside of the kernel
+    bool copy_data(int fd_in, loff_t off_in, int fd_out, loff_t off_out, std::span<const uint8_t> data) {
+        if (fd_in < 0) {
+            // nothing to copy from, data lives only in memory
+            return write_all(fd_out, off_out, data.data(), data.size());
+        }
+        if (mode == COPY_FILE_RANGE) {
+            const loff_t out_end = off_out + data.size();
+            while (true) {
+                ssize_t size = out_end - off_out;
+                auto res = copy_file_range(fd_in, &off_in, fd_out, &off_out, size, 0);
+                if (res == 0 || res == size) {
+                    return true;
+                }
+                if (res == -1) {
+                    // continue where it stopped
+                    data = data.subspan(data.size() - size);
+                    mode = SENDFILE;
+                    break;
+                }
+            }
+        }
+        if (mode == SENDFILE) {
+            lseek(fd_out, off_out, SEEK_SET);
+            while (true) {
+                ssize_t size = data.size();
+                auto res = sendfile(fd_out, fd_in, &off_in, size);
+                if (res == 0 || res == size) {
+                    // man page doesn't mention in_fd eof case as in copy_file_range
+                    // but it looks like it might return 0
+                    // but it should never occur
+                    return true;
+                }
+                if (res == -1) {
+                    mode = WRITE;
+                    break;
+                }
+                data = data.subspan(res);
+                off_out += res;
+            }
+        }
+        return write_all(fd_out, off_out, data.data(), data.size());
+    }
+
+    // shares the block aligned middle of data with fd_in, copies head and tail
+    // only possible if both offsets have the same distance to a block boundary
+    bool transfer(int fd_in, loff_t off_in, int fd_out, loff_t off_out, std::span<const uint8_t> data) {
+        if (reflink && fd_in >= 0 && off_in % clone_block == off_out % clone_block) {
+            const size_t head = (clone_block - off_in % clone_block) % clone_block;
+            const size_t middle = data.size() > head ? (data.size() - head) / clone_block * clone_block : 0;
+            if (middle) {
+                // head first, so the clone never lands behind the end of the file
+                if (!copy_data(fd_in, off_in, fd_out, off_out, data.first(head))) {
+                    return false;
+                }
+                file_clone_range range{};
+                range.src_fd = fd_in;
+                range.src_offset = off_in + head;
+                range.src_length = middle;
+                range.dest_offset = off_out + head;
+                if (ioctl(fd_out, FICLONERANGE, &range) == 0) {
+                    const auto tail = data.subspan(head + middle);
+                    stats.shared += middle;
+                    stats.copied += head + tail.size();
+                    return copy_data(fd_in, off_in + head + middle, fd_out, off_out + head + middle, tail);
+                }
+                if (errno != EINVAL) {
+                    // different filesystems or no support at all, don't try again
+                    reflink = false;
+                }
+            }
+        }
+        stats.copied += data.size();
+        return copy_data(fd_in, off_in, fd_out, off_out, data);
+    }
+
+    output_location write_file(int fd, size_t offset, std::span<const uint8_t> data, const std::string& dir, const std::string& name) {
+        if (dir != last_dir) {
+            // parents first, e.g. the directory of the input
+            for (auto i = dir.find('/'); i != std::string::npos; i = dir.find('/', i + 1)) {
+                mkdir(dir.substr(0, i).c_str(), 0750);
+            }
+            mkdir(dir.c_str(), 0750);
+            last_dir = dir;
+        }
+        auto fd_img = open(name.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0640);
+        if (fd_img == -1) {
+            fail(std::format("couldn't create new file {}", name));
+        }
+        if (!transfer(fd, offset, fd_img, 0, data)) {
+            unlink(name.c_str());
+            fail(std::format("couldn't write to file {}", name));
+        }
+        close(fd_img);
+        return {};
+    }
+
+    void octal(char* field, size_t size, uint64_t value) {
+        // size - 1 digits and a NUL
+        field[size - 1] = '\0';
+        for (size_t i = size - 1; i > 0; --i) {
+            field[i - 1] = '0' + (value & 7);
+            value >>= 3;
+        }
+    }
+
+    // https://pubs.opengroup.org/onlinepubs/9699919799/utilities/pax.html#tag_20_92_13_06
+    struct tar_header {
+        char name[100];
+        char mode[8];
+        char uid[8];
+        char gid[8];
+        char size[12];
+        char mtime[12];
+        char chksum[8];
+        char typeflag;
+        char linkname[100];
+        char magic[6];
+        char version[2];
+        char uname[32];
+        char gname[32];
+        char devmajor[8];
+        char devminor[8];
+        char prefix[155];
+        char pad[12];
+    };
+    static_assert(sizeof(tar_header) == BLOCK);
+
+    tar_header make_header(const std::string& name, uint64_t size, char typeflag) {
+        tar_header h{};
+        std::memcpy(h.name, name.data(), std::min(name.size(), sizeof(h.name)));
+        octal(h.mode, sizeof(h.mode), 0640);
+        octal(h.uid, sizeof(h.uid), getuid());
+        octal(h.gid, sizeof(h.gid), getgid());
+        octal(h.size, sizeof(h.size), size);
+        octal(h.mtime, sizeof(h.mtime), time(nullptr));
+        h.typeflag = typeflag;
+        std::memcpy(h.magic, "ustar", 6);
+        std::memcpy(h.version, "00", 2);
+        std::memset(h.chksum, ' ', sizeof(h.chksum));
+        unsigned sum = 0;
+        for (auto c : std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(&h), sizeof(h))) {
+            sum += c;
+        }
+        octal(h.chksum, sizeof(h.chksum) - 1, sum);
+        return h;
+    }
+
+    void archive_append(const void* data, size_t size) {
+        if (!write_all(archive_fd, archive_offset, static_cast<const uint8_t*>(data), size)) {
+            fail(std::format("couldn't write to archive {}", archive_name));
+        }
+        archive_offset += size;
+    }
+
+    void archive_pad() {
+        static const uint8_t zeros[BLOCK] = {};
+        if (archive_offset % BLOCK) {
+            archive_append(zeros, BLOCK - archive_offset % BLOCK);
+        }
+    }
+
+    void archive_finish() {
+        if (archive_fd == -1) {
+            return;
+        }
+        // end of archive, two empty blocks
+        static const uint8_t zeros[2 * BLOCK] = {};
+        archive_append(zeros, sizeof(zeros));
+        close(archive_fd);
+        archive_fd = -1;
+    }
+
+    void archive_next() {
+        archive_finish();
+        archive_name = std::format("images.{:04d}.tar", ++archive_index);
+        archive_fd = open(archive_name.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0640);
+        if (archive_fd == -1) {
+            fail(std::format("couldn't create archive {}", archive_name));
+        }
+        archive_offset = 0;
+    }
+
+    // "<length> key=value\n", the length includes itself
+    std::string pax_record(const std::string& key, const std::string& value) {
+        auto record = std::format(" {}={}\n", key, value);
+        auto length = record.size() + 1;
+        while (std::to_string(length).size() + record.size() != length) {
+            ++length;
+        }
+        return std::to_string(length) + record;
+    }
+
+    output_location write_tar(int fd, size_t offset, std::span<const uint8_t> data, const std::string& name) {
+        // worst case: pax header + record + alignment + header + data + padding + end of archive
+        const auto needed = 4 * BLOCK + clone_block + data.size() + 3 * BLOCK;
+        if (archive_fd == -1 || (split && archive_offset && archive_offset + needed > split)) {
+            archive_next();
+        }
+
+        std::string records;
+        if (name.size() > sizeof(tar_header::name)) {
+            // pax extended header for the long path
+            records = pax_record("path", name);
+        }
+        // 11 octal digits end just below 8GiB
+        const bool large = data.size() > 077777777777;
+        if (large) {
+            records += pax_record("size", std::to_string(data.size()));
+        }
+        // for a reflink the data has to sit at the same distance to a block boundary as in the input
+        // tar only knows 512 byte blocks, the gap is filled with a pax comment
+        const bool align = reflink && offset % BLOCK == 0 && data.size() >= 2 * clone_block;
+        const auto target = offset % clone_block;
+        auto data_start = [&](size_t pax_size) {
+            return archive_offset + (pax_size ? BLOCK + pax_size : 0) + BLOCK;
+        };
+        if (align && data_start(records.size()) % clone_block != target) {
+            constexpr size_t MIN_COMMENT = 16;
+            auto pax_size = (records.size() + MIN_COMMENT + BLOCK - 1) / BLOCK * BLOCK;
+            while (data_start(pax_size) % clone_block != target) {
+                pax_size += BLOCK;
+            }
+            // exactly fill pax_size, so no padding is needed
+            const auto comment = pax_size - records.size();
+            auto n = comment;
+            std::string record;
+            do {
+                record = pax_record("comment", std::string(--n, ' '));
+            } while (record.size() > comment);
+            records += record;
+        }
+        if (!records.empty()) {
+            auto pax = make_header("PaxHeader", records.size(), 'x');
+            archive_append(&pax, sizeof(pax));
+            archive_append(records.data(), records.size());
+            archive_pad();
+        }
+        // the size of a large one is only in the pax record
+        auto header = make_header(name, large ? 0 : data.size(), '0');
+        archive_append(&header, sizeof(header));
+
+        output_location location{ archive_name, archive_offset };
+        if (!transfer(fd, offset, archive_fd, archive_offset, data)) {
+            fail(std::format("couldn't write to archive {}", archive_name));
+        }
+        archive_offset += data.size();
+        archive_pad();
+        return location;
+    }
+}
+
+void output_open(OUTPUT t, size_t s, bool r) {
+    type = t;
+    split = s;
+    struct statfs st;
+    if (r && statfs(".", &st) == 0 && st.f_bsize > 0) {
+        reflink = true;
+        clone_block = st.f_bsize;
+    }
+}
+
+output_location output_write(int fd, size_t offset, std::span<const uint8_t> data, const std::string& dir, const std::string& name) {
+    if (type == TAR) {
+        return write_tar(fd, offset, data, name);
+    }
+    return write_file(fd, offset, data, dir, name);
+}
+
+void output_close() {
+    archive_finish();
+}
+
+output_stats output_statistics() {
+    return stats;
+}
@@ -0,0 +1,35 @@
+#ifndef H_OUTPUT
+#define H_OUTPUT
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+
+enum OUTPUT {
+    FILES,  // one file per image in directories of 4096
+    TAR     // everything streamed into a few large tar archives
+};
+
+// where the data ended up, for the manifest
+struct output_location {
+    std::string archive; // empty when written as its own file
+    uint64_t offset = 0; // of the data inside of the archive
+};
+
+// bytes written to the output
+struct output_stats {
+    uint64_t shared = 0; // reflinked with the input
+    uint64_t copied = 0;
+};
+
+// split starts a new archive once the current one would grow past it, 0 never splits
+// reflink shares the block aligned parts of every image with the input (btrfs, XFS)
+void output_open(OUTPUT type, size_t split = 0, bool reflink = false);
+// data must be the bytes at offset in fd, fd is used for copy_file_range when possible
+// fd is -1 if the data only exists in memory
+output_location output_write(int fd, size_t offset, std::span<const uint8_t> data, const std::string& dir, const std::string& name);
+void output_close();
+output_stats output_statistics();
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef H_PARSER
+#define H_PARSER
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include "utils.h"
+
+// the parsers are fed the bytes of a candidate buffer by buffer, from its first byte on
+// they keep nothing but their state, so an image may be split over any number of buffers
+enum PARSE {
+    PARSE_MORE,     // needs the next buffer
+    PARSE_DONE,     // size() is the length of the image
+    PARSE_FAILED
+};
+
+// collects a header that may be split over several buffers
+template<size_t N> struct gather {
+    uint8_t bytes[N];
+    size_t have = 0;
+    size_t want = 0;
+
+    void start(size_t n) {
+        have = 0;
+        want = n;
+    }
+
+    // takes what is missing from the front of data, true once all of it is there
+    bool take(std::span<const uint8_t>& data) {
+        const auto n = std::min(want - have, data.size());
+        fuzz_count(n);
+        std::memcpy(bytes + have, data.data(), n);
+        have += n;
+        data = data.subspan(n);
+        return have == want;
+    }
+
+    uint8_t operator[](size_t i) const {
+        return bytes[i];
+    }
+};
+
+// false if data can't start with magic, shorter data is compared as far as it goes
+template<typename T> bool starts_with(std::span<const uint8_t> data, T magic) {
+    if (data.size() >= sizeof(T)) [[likely]] {
+        return std::memcmp(data.data(), &magic, sizeof(T)) == 0;
+    }
+    return std::memcmp(data.data(), &magic, data.size()) == 0;
+}
+
+// skips up to n bytes of data, returns how many are left to skip
+inline uint64_t skip_bytes(std::span<const uint8_t>& data, uint64_t n) {
+    const auto s = std::min<uint64_t>(n, data.size());
+    fuzz_count(0);
+    data = data.subspan(s);
+    return n - s;
+}
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef H_PARSERS
+#define H_PARSERS
+
+#include <variant>
+#include "image_info.h"
+#include "read_jpg.h"
+#include "read_png.h"
+#include "read_tif.h"
+#include "read_gif.h"
+#include "read_webp.h"
+#include "read_bmp.h"
+#include "read_ico.h"
+#include "read_psd.h"
+#include "read_jp2.h"
+#include "read_jxl.h"
+
+// one parser of each format, in the order of FORMAT
+using parser = std::variant<jpg_parser, png_parser, tif_parser, gif_parser, webp_parser, bmp_parser, ico_parser, psd_parser, jp2_parser, jxl_parser>;
+
+// starts p on the candidate at the front of data, false if no format starts like it
+// tif waits for at most limit bytes
+inline bool open_parser(parser& p, std::span<const uint8_t> data, bool strict_gif, uint64_t limit) {
+    switch (data[0]) {
+        case FIRST_BYTE_JPG:
+            if (!jpg_parser::starts(data)) {
+                return false;
+            }
+            p.emplace<jpg_parser>();
+            return true;
+        case FIRST_BYTE_PNG:
+            if (!png_parser::starts(data)) {
+                return false;
+            }
+            p.emplace<png_parser>();
+            return true;
+        case FIRST_BYTE_TIF_BIG:
+        case FIRST_BYTE_TIF_LITTLE:
+            if (!tif_parser::starts(data)) {
+                return false;
+            }
+            p.emplace<tif_parser>(limit);
+            return true;
+        case FIRST_BYTE_GIF:
+            if (!gif_parser::starts(data)) {
+                return false;
+            }
+            p.emplace<gif_parser>(strict_gif);
+            return true;
+        case FIRST_BYTE_WEBP:
+            if (!webp_parser::starts(data)) {
+                return false;
+            }
+            p.emplace<webp_parser>();
+            return true;
+        case FIRST_BYTE_BMP:
+            if (!bmp_parser::starts(data)) {
+                return false;
+            }
+            p.emplace<bmp_parser>();
+            return true;
+        case FIRST_BYTE_PSD:
+            if (!psd_parser::starts(data)) {
+                return false;
+            }
+            p.emplace<psd_parser>();
+            return true;
+        // FIRST_BYTE_ICO, FIRST_BYTE_JP2 and FIRST_BYTE_JXL
+        case 0x00:
+            if (ico_parser::starts(data)) {
+                p.emplace<ico_parser>();
+                return true;
+            }
+            if (jp2_parser::starts(data)) {
+                p.emplace<jp2_parser>();
+                return true;
+            }
+            if (jxl_parser::starts(data)) {
+                p.emplace<jxl_parser>();
+                return true;
+            }
+            return false;
+    }
+    return false;
+}
+
+// true if data starts like an image of any format, see open_parser
+inline bool starts_image(std::span<const uint8_t> data) {
+    switch (data[0]) {
+        case FIRST_BYTE_JPG:
+            return jpg_parser::starts(data);
+        case FIRST_BYTE_PNG:
+            return png_parser::starts(data);
+        case FIRST_BYTE_TIF_BIG:
+        case FIRST_BYTE_TIF_LITTLE:
+            return tif_parser::starts(data);
+        case FIRST_BYTE_GIF:
+            return gif_parser::starts(data);
+        case FIRST_BYTE_WEBP:
+            return webp_parser::starts(data);
+        case FIRST_BYTE_BMP:
+            return bmp_parser::starts(data);
+        case FIRST_BYTE_PSD:
+            return psd_parser::starts(data);
+        case 0x00:
+            return ico_parser::starts(data) || jp2_parser::starts(data) || jxl_parser::starts(data);
+    }
+    return false;
+}
+
+inline PARSE feed(parser& p, std::span<const uint8_t> data) {
+    return std::visit([data](auto& q) { return q.feed(data); }, p);
+}
+
+inline FORMAT format_of(const parser& p) {
+    return FORMAT(p.index());
+}
+
+// length of the image once feed returned PARSE_DONE
+inline uint64_t size_of(const parser& p) {
+    return std::visit([](const auto& q) { return q.size(); }, p);
+}
+
+inline const image_info& info_of(const parser& p) {
+    return std::visit([](const auto& q) -> const image_info& { return q.info; }, p);
+}
+
+#endif
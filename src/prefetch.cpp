@@ -0,0 +1,114 @@
+#include "prefetch.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22 // linux 5.14
+#endif
+
+namespace {
+    constexpr size_t STEP = 8 * 1024 * 1024;
+    // parsers and pending checks still look a little behind the cursor
+    constexpr size_t KEEP_BEHIND = 64 * 1024 * 1024;
+    // how far ahead we want to be, in seconds of scanning
+    constexpr double LEAD_TIME = 2.0;
+    constexpr auto TICK = std::chrono::milliseconds(10);
+}
+
+prefetcher::prefetcher(int fd, const uint8_t* base, size_t size, size_t min_distance, size_t rss_cap, std::vector<range> ranges) :
+    fd(fd), base(base), size(size), min_distance(min_distance), rss_cap(rss_cap), ranges(std::move(ranges))
+{
+    thread = std::thread([this] { run(); });
+}
+
+prefetcher::~prefetcher() {
+    stopping = true;
+    thread.join();
+}
+
+void prefetcher::populate(size_t offset, size_t length) {
+    static std::atomic<bool> populate_read = true;
+    // the ends of the ranges and the target aren't on a page, madvise wants its start on one
+    const size_t pagesize = getpagesize();
+    const auto start = offset / pagesize * pagesize;
+    length += offset - start;
+    if (populate_read) {
+        if (madvise((void*)(base + start), length, MADV_POPULATE_READ) == 0) {
+            return;
+        }
+        if (errno != EINVAL) {
+            // unreadable pages, the scanner will run into them itself
+            return;
+        }
+        // kernel too old, the call itself was fine
+        populate_read = false;
+    }
+    readahead(fd, start, length);
+}
+
+void prefetcher::run() {
+    const size_t pagesize = getpagesize();
+    const size_t keep_behind = rss_cap ? std::min(KEEP_BEHIND, rss_cap / 4) : KEEP_BEHIND;
+
+    size_t fetched = 0;
+    size_t released = 0;
+    size_t next_range = 0;
+
+    double rate = 0; // bytes per second of the scanner
+    auto last_time = std::chrono::steady_clock::now();
+    size_t last_cursor = 0;
+
+    while (!stopping) {
+        const size_t pos = cursor.load(std::memory_order_relaxed);
+
+        const auto now = std::chrono::steady_clock::now();
+        const std::chrono::duration<double> elapsed = now - last_time;
+        if (elapsed.count() >= 0.1) {
+            const auto current = (pos - last_cursor) / elapsed.count();
+            rate = rate ? 0.8 * rate + 0.2 * current : current;
+            last_time = now;
+            last_cursor = pos;
+        }
+
+        // drop everything behind us
+        const size_t keep_from = pos > keep_behind ? (pos - keep_behind) / pagesize * pagesize : 0;
+        if (keep_from > released) {
+            madvise((void*)(base + released), keep_from - released, MADV_DONTNEED);
+            released = keep_from;
+        }
+
+        // the scanner overtook us, no point in fetching what it already read
+        fetched = std::max(fetched, pos / pagesize * pagesize);
+
+        const size_t distance = std::max(min_distance, size_t(rate * LEAD_TIME));
+        size_t target = std::min(size, pos + distance);
+        if (rss_cap) {
+            target = std::min(target, released + rss_cap);
+        }
+        // skip the gaps between the ranges
+        size_t limit = size;
+        if (!ranges.empty()) {
+            while (next_range < ranges.size() && ranges[next_range].end() <= fetched) {
+                ++next_range;
+            }
+            if (next_range == ranges.size()) {
+                fetched = size;
+            } else {
+                fetched = std::max<size_t>(fetched, ranges[next_range].offset / pagesize * pagesize);
+                limit = ranges[next_range].end();
+            }
+        }
+        if (fetched < target) {
+            const auto length = std::min({ STEP, target - fetched, limit - fetched });
+            populate(fetched, length);
+            fetched += length;
+            continue;
+        }
+
+        std::this_thread::sleep_for(TICK);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef H_PREFETCH
+#define H_PREFETCH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "range.h"
+
+// keeps the pages in front of the scan cursor resident and drops the ones behind it
+// the distance follows the measured scan throughput and is bounded by rss_cap
+// only the given ranges are read, everything if there are none
+class prefetcher {
+public:
+    prefetcher(int fd, const uint8_t* base, size_t size, size_t min_distance, size_t rss_cap, std::vector<range> ranges = {});
+    ~prefetcher();
+
+    prefetcher(const prefetcher&) = delete;
+    prefetcher& operator=(const prefetcher&) = delete;
+
+    // called by the scanner, cheap enough for every iteration
+    void advance(size_t offset) {
+        cursor.store(offset, std::memory_order_relaxed);
+    }
+
+private:
+    void run();
+    void populate(size_t offset, size_t length);
+
+    const int fd;
+    const uint8_t* const base;
+    const size_t size;
+    const size_t min_distance;
+    const size_t rss_cap;
+    const std::vector<range> ranges;
+    std::atomic<size_t> cursor = 0;
+    std::atomic<bool> stopping = false;
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef H_RANGE
+#define H_RANGE
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// part of a disk image the scan visits
+// only offset, offset + alignment, .. are tried, e.g. the clusters of a filesystem
+struct range {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t alignment = 1;
+
+    uint64_t end() const {
+        return offset + length;
+    }
+};
+
+// sorts and joins overlapping ranges, only used for ranges without alignment
+inline std::vector<range> merge(std::vector<range> ranges) {
+    std::sort(ranges.begin(), ranges.end(), [](const range& a, const range& b) { return a.offset < b.offset; });
+    std::vector<range> result;
+    for (const auto& r : ranges) {
+        if (!result.empty() && r.offset <= result.back().end()) {
+            result.back().length = std::max(result.back().end(), r.end()) - result.back().offset;
+        } else {
+            result.push_back(r);
+        }
+    }
+    return result;
+}
+
+// the parts of ranges that are also in with, both sorted, keeps the alignment of ranges
+inline std::vector<range> intersect(const std::vector<range>& ranges, const std::vector<range>& with) {
+    std::vector<range> result;
+    size_t w = 0;
+    for (const auto& r : ranges) {
+        while (w < with.size() && with[w].end() <= r.offset) {
+            ++w;
+        }
+        for (auto i = w; i < with.size() && with[i].offset < r.end(); ++i) {
+            const auto skipped = with[i].offset > r.offset ? with[i].offset - r.offset : 0;
+            const auto from = r.offset + (skipped + r.alignment - 1) / r.alignment * r.alignment;
+            const auto to = std::min(r.end(), with[i].end());
+            if (from < to) {
+                result.push_back({ from, to - from, r.alignment });
+            }
+        }
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,217 @@
+#include "read_bmp.h"
+#include "utils.h"
+#include <cstdlib>
+
+namespace {
+    template<typename T>
+    T _read(std::span<const uint8_t>& data) {
+        return ::read<T, std::endian::little>(data);
+    }
+
+    constexpr auto SIGNATURE = convert<uint16_t, std::endian::native, std::endian::big>(0x424D);
+
+    // BITMAPCOREHEADER, BITMAPINFOHEADER, the undocumented V2 and V3, OS/2 2.x, BITMAPV4HEADER and BITMAPV5HEADER
+    bool valid_dib_size(uint32_t size) {
+        switch (size) {
+            case 12:
+            case 40:
+            case 52:
+            case 56:
+            case 64:
+            case 108:
+            case 124:
+                return true;
+        }
+        return false;
+    }
+
+    enum COMPRESSION : uint32_t {
+        BI_RGB = 0,
+        BI_RLE8 = 1,
+        BI_RLE4 = 2,
+        BI_BITFIELDS = 3,
+        BI_JPEG = 4,
+        BI_PNG = 5,
+        BI_ALPHABITFIELDS = 6
+    };
+
+    const char* compression_name(uint32_t compression) {
+        switch (compression) {
+            case BI_RLE8:           return "rle8";
+            case BI_RLE4:           return "rle4";
+            case BI_BITFIELDS:      return "bitfields";
+            case BI_JPEG:           return "jpeg";
+            case BI_PNG:            return "png";
+            case BI_ALPHABITFIELDS: return "bitfields";
+            default:                return "";
+        }
+    }
+}
+
+// based on https://learn.microsoft.com/en-us/windows/win32/gdi/bitmap-storage
+
+bool bmp_parser::starts(std::span<const uint8_t> data) {
+    // "BM" alone turns up every 64KiB of random data
+    if (!starts_with(data, SIGNATURE) || !starts_with(subspan(data, 6), uint32_t(0))) {
+        return false;
+    }
+    return data.size() < 18 || valid_dib_size(peek<uint32_t, std::endian::little>(data, 14));
+}
+
+PARSE bmp_parser::file_header() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    if (read<decltype(SIGNATURE)>(data) != SIGNATURE) {
+        return PARSE_FAILED;
+    }
+    file_size = _read<uint32_t>(data);
+    // reserved
+    if (_read<uint32_t>(data) != 0) {
+        return PARSE_FAILED;
+    }
+    offset = _read<uint32_t>(data);
+    dib_size = _read<uint32_t>(data);
+    if (!valid_dib_size(dib_size) || offset < 14 + dib_size || offset >= file_size) {
+        return PARSE_FAILED;
+    }
+    dib.start(std::min<uint32_t>(dib_size, 40) - sizeof(uint32_t));
+    expect = DIB_HEADER;
+    return PARSE_MORE;
+}
+
+PARSE bmp_parser::dib_header() {
+    auto data = std::span<const uint8_t>(dib.bytes, dib.have);
+    int64_t width = 0;
+    int64_t height = 0;
+    uint16_t bits = 0;
+    uint32_t compression = BI_RGB;
+    uint32_t image_size = 0;
+    uint64_t colors = 0;
+    uint64_t masks = 0;
+    if (dib_size == 12) {
+        width = _read<uint16_t>(data);
+        height = _read<uint16_t>(data);
+        if (_read<uint16_t>(data) != 1) {
+            // planes
+            return PARSE_FAILED;
+        }
+        bits = _read<uint16_t>(data);
+        if (bits != 1 && bits != 4 && bits != 8 && bits != 24) {
+            return PARSE_FAILED;
+        }
+        colors = bits <= 8 ? 3 << bits : 0;
+    } else {
+        width = _read<int32_t>(data);
+        height = _read<int32_t>(data);
+        if (_read<uint16_t>(data) != 1) {
+            // planes
+            return PARSE_FAILED;
+        }
+        bits = _read<uint16_t>(data);
+        compression = _read<uint32_t>(data);
+        image_size = _read<uint32_t>(data);
+        skip<uint32_t>(data, 2); // resolution
+        const auto used = _read<uint32_t>(data);
+        const auto important = _read<uint32_t>(data);
+        switch (compression) {
+            case BI_RGB:
+                if (bits != 1 && bits != 4 && bits != 8 && bits != 16 && bits != 24 && bits != 32) {
+                    return PARSE_FAILED;
+                }
+                break;
+            case BI_RLE8:
+            case BI_RLE4:
+                if (bits != (compression == BI_RLE8 ? 8 : 4) || height < 0) {
+                    // RLE is always bottom-up
+                    return PARSE_FAILED;
+                }
+                break;
+            case BI_BITFIELDS:
+            case BI_ALPHABITFIELDS:
+                if (bits != 16 && bits != 32) {
+                    return PARSE_FAILED;
+                }
+                // the masks follow BITMAPINFOHEADER, the later headers contain them
+                if (dib_size == 40) {
+                    masks = compression == BI_BITFIELDS ? 12 : 16;
+                }
+                break;
+            case BI_JPEG:
+            case BI_PNG:
+                if (bits != 0 || height < 0) {
+                    return PARSE_FAILED;
+                }
+                break;
+            default:
+                return PARSE_FAILED;
+        }
+        if (bits <= 8 && bits && (used > (1u << bits) || important > std::max(used, 1u << bits))) {
+            return PARSE_FAILED;
+        }
+        colors = 4 * uint64_t(used ? used : bits && bits <= 8 ? 1u << bits : 0);
+    }
+    if (width <= 0 || height == 0) {
+        return PARSE_FAILED;
+    }
+    height = std::abs(height);
+    if (offset < 14 + dib_size + masks + colors) {
+        // the color table is in front of the pixels
+        return PARSE_FAILED;
+    }
+    if (compression == BI_RGB || compression == BI_BITFIELDS || compression == BI_ALPHABITFIELDS) {
+        const uint64_t row = (uint64_t(width) * bits + 31) / 32 * 4;
+        if (offset + row * height > file_size) {
+            return PARSE_FAILED;
+        }
+    } else if (image_size == 0 || offset + uint64_t(image_size) > file_size) {
+        // compressed images have to tell their size
+        return PARSE_FAILED;
+    }
+
+    info.width = width;
+    info.height = height;
+    info.variant = compression_name(compression);
+    left = file_size - (14 + std::min<uint32_t>(dib_size, 40));
+    expect = SKIP;
+    return PARSE_MORE;
+}
+
+PARSE bmp_parser::feed(std::span<const uint8_t> data) {
+    const auto available = data.size();
+    auto result = PARSE_MORE;
+    while (result == PARSE_MORE && !data.empty()) {
+        switch (expect) {
+            case FILE_HEADER:
+                if (head.take(data)) {
+                    result = file_header();
+                }
+                break;
+            case DIB_HEADER:
+                if (dib.take(data)) {
+                    result = dib_header();
+                }
+                break;
+            case SKIP:
+                left = skip_bytes(data, left);
+                if (left == 0) {
+                    result = PARSE_DONE;
+                }
+                break;
+        }
+    }
+    consumed += available - data.size();
+    return result;
+}
+
+std::span<const uint8_t> read_bmp(std::span<const uint8_t> data, image_info* info) {
+    if (!bmp_parser::starts(data)) [[likely]] {
+        return {};
+    }
+    bmp_parser parser;
+    if (parser.feed(data) != PARSE_DONE) {
+        return {};
+    }
+    if (info) {
+        *info = parser.info;
+    }
+    return data.first(parser.size());
+}
@@ -0,0 +1,43 @@
+#ifndef H_READ_BMP
+#define H_READ_BMP
+
+#include <span>
+#include <cstdint>
+#include "image_info.h"
+#include "parser.h"
+
+constexpr uint8_t FIRST_BYTE_BMP = 0x42;
+std::span<const uint8_t> read_bmp(std::span<const uint8_t> data, image_info* info = nullptr);
+
+// read_bmp as a state machine, see parser.h
+class bmp_parser {
+public:
+    // false if data can't be the start of one, looks at the signature, reserved bytes and DIB header size
+    static bool starts(std::span<const uint8_t> data);
+    PARSE feed(std::span<const uint8_t> data);
+    uint64_t size() const {
+        return consumed;
+    }
+    image_info info;
+
+private:
+    enum EXPECT : uint8_t {
+        FILE_HEADER,    // and the size of the DIB header
+        DIB_HEADER,     // the rest of it, up to BITMAPINFOHEADER
+        SKIP            // up to the size of the file header
+    };
+
+    PARSE file_header();
+    PARSE dib_header();
+
+    EXPECT expect = FILE_HEADER;
+    uint32_t file_size = 0;
+    uint32_t offset = 0;        // of the pixels
+    uint32_t dib_size = 0;
+    uint64_t left = 0;
+    gather<18> head{ {}, 0, 18 };
+    gather<36> dib;
+    uint64_t consumed = 0;
+};
+
+#endif
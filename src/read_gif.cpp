@@ -8,125 +8,302 @@ namespace {
         return ::read<T, std::endian::little>(data);
     }
 
+    uint16_t _read16(const uint8_t* p) {
+        return p[0] | (p[1] << 8);
+    }
+
     constexpr auto SIGNATURE = convert<uint32_t, std::endian::native, std::endian::big>(0x47494638);
     constexpr auto VERSION_87A = convert<uint16_t, std::endian::native, std::endian::big>(0x3761);
     constexpr auto VERSION_89A = convert<uint16_t, std::endian::native, std::endian::big>(0x3961);
 }
 
-std::span<const uint8_t> read_gif(std::span<const uint8_t> data) {
-    // based on https://giflib.sourceforge.net/whatsinagif/bits_and_bytes.html
-
-    if (peek<decltype(SIGNATURE)>(data) != SIGNATURE) [[likely]] {
-        return {};
-    }
+// based on https://giflib.sourceforge.net/whatsinagif/bits_and_bytes.html
+// and https://www.w3.org/Graphics/GIF/spec-gif89a.txt
 
-    const auto start = data.data();
+bool gif_parser::starts(std::span<const uint8_t> data) {
+    return starts_with(data, SIGNATURE);
+}
 
-    skip<decltype(SIGNATURE)>(data);
-    if (
-        (peek<decltype(VERSION_87A)>(data) != VERSION_87A) &&
-        (peek<decltype(VERSION_89A)>(data) != VERSION_89A)
-    ) {
-        return {};
+PARSE gif_parser::header() {
+    auto data = std::span<const uint8_t>(head.bytes);
+    if (read<decltype(SIGNATURE)>(data) != SIGNATURE) {
+        return PARSE_FAILED;
     }
-    skip<decltype(VERSION_89A)>(data);
-
-    skip<uint16_t>(data); // width
-    skip<uint16_t>(data); // height
+    const auto version = read<decltype(VERSION_89A)>(data);
+    if (version != VERSION_87A && version != VERSION_89A) {
+        return PARSE_FAILED;
+    }
+    screen_width = _read<uint16_t>(data);
+    screen_height = _read<uint16_t>(data);
     auto flags = _read<uint8_t>(data);
-    skip<uint8_t>(data); // background color index
-    skip<uint8_t>(data); // pixel aspect ratio
+    info.variant = version == VERSION_89A ? "89a" : "87a";
 
     bool global_color_table_flag = (flags >> 7) & 1;
     int  size_of_global_color_table = flags & 7;
 
     if (global_color_table_flag) {
         auto N = 1 << (size_of_global_color_table + 1);
-        auto S = 3 * N;
-        skip<uint8_t>(data, S);
+        left = 3 * N;
+        after = BLOCK;
+        expect = SKIP;
+    } else {
+        expect = BLOCK;
     }
+    return PARSE_MORE;
+}
 
-    bool found_trailer = false;
-    bool found_imagedescriptor = false;
+PARSE gif_parser::descriptor() {
+    // left, top, width, height, flags
+    const auto left = _read16(head.bytes);
+    const auto top = _read16(head.bytes + 2);
+    const auto width = _read16(head.bytes + 4);
+    const auto height = _read16(head.bytes + 6);
+    const auto flags = head[8];
+    if (strict && (
+        width == 0 || height == 0 ||
+        left + width > screen_width ||
+        top + height > screen_height
+    )) {
+        return PARSE_FAILED;
+    }
+    pixels_max = uint64_t(width) * height;
+    bool local_color_table_flag = (flags >> 7) & 1;
+    int  size_of_local_color_table = flags & 7;
+    // read color table
+    if (local_color_table_flag) {
+        auto N = 1 << (size_of_local_color_table + 1);
+        this->left = 3 * N;
+        after = MIN_CODE_SIZE;
+        expect = SKIP;
+    } else {
+        expect = MIN_CODE_SIZE;
+    }
+    return PARSE_MORE;
+}
 
-    while (!found_trailer && !data.empty()) {
-        auto introducer = _read<uint8_t>(data);
+// runs the LZW decoder without producing any output
+// checks every code against the table and counts the pixels
+void gif_parser::start_lzw(uint8_t size) {
+    min_code_size = size;
+    clear = 1 << min_code_size;
+    eoi = clear + 1;
+    lengths.resize(4096);
+    for (uint32_t i = 0; i < clear; ++i) {
+        lengths[i] = 1;
+    }
+    fuzz_count(0, clear);
+    next = eoi + 1;
+    code_size = min_code_size + 1;
+    prev = -1;
+    pixels = 0;
+    bits = 0;
+    bit_count = 0;
+    found_eoi = false;
+}
 
-        switch (introducer) {
-            case 0x21: // extension introducer
+// false on an invalid stream
+bool gif_parser::lzw(std::span<const uint8_t> data) {
+    fuzz_count(data.size(), data.size());
+    // data after EOI is ignored by decoders
+    for (auto p = data.begin(); p != data.end() && !found_eoi; ++p) {
+        bits |= uint32_t(*p) << bit_count;
+        bit_count += 8;
+        while (bit_count >= code_size) {
+            const auto code = bits & ((1 << code_size) - 1);
+            bits >>= code_size;
+            bit_count -= code_size;
+
+            if (code == clear) {
+                next = eoi + 1;
+                code_size = min_code_size + 1;
+                prev = -1;
+                continue;
+            }
+            if (code == eoi) {
+                found_eoi = true;
+                break;
+            }
+            if (prev < 0) {
+                // first code after a clear has to be a literal
+                if (code > clear) {
+                    return false;
+                }
+                pixels += 1;
+                prev = code;
+                continue;
+            }
+            if (code > next || (code == next && next >= 4096)) {
+                return false;
+            }
+            pixels += code == next ? lengths[prev] + 1 : lengths[code];
+            if (next < 4096) {
+                lengths[next] = lengths[prev] + 1;
+                ++next;
+                if (next == (1u << code_size) && code_size < 12) {
+                    ++code_size;
+                }
+            }
+            prev = code;
+        }
+    }
+    return true;
+}
+
+PARSE gif_parser::feed(std::span<const uint8_t> data) {
+    const auto available = data.size();
+    auto result = PARSE_MORE;
+    while (result == PARSE_MORE && !data.empty()) {
+        switch (expect) {
+            case HEADER:
+                if (head.take(data)) {
+                    result = header();
+                }
+                break;
+            case SKIP:
+                left = skip_bytes(data, left);
+                if (left == 0) {
+                    expect = after;
+                }
+                break;
+            case BLOCK:
+            {
+                const auto introducer = data[0];
+                data = data.subspan(1);
+                switch (introducer) {
+                    case 0x21: // extension introducer
+                        expect = LABEL;
+                        break;
+                    case 0x2C: // image descriptor
+                        ++frames;
+                        head.start(9);
+                        expect = DESCRIPTOR;
+                        break;
+                    case 0x3B: // trailer
+                        if (frames == 0) {
+                            result = PARSE_FAILED;
+                            break;
+                        }
+                        info.width = screen_width;
+                        info.height = screen_height;
+                        info.parts = frames;
+                        result = PARSE_DONE;
+                        break;
+                    default:
+                        result = PARSE_FAILED;
+                        break;
+                }
+            } break;
+            case LABEL:
             {
-                auto label = _read<uint8_t>(data);
+                const auto label = data[0];
+                data = data.subspan(1);
                 switch (label) {
                     case 0x01: // plain text
                     case 0xFF: // application
-                    {
-                        skip<uint8_t>(data, peek<uint8_t>(data));
-                        // read data
-                        auto size = _read<uint8_t>(data);
-                        while (size) {
-                            skip<uint8_t>(data, size);
-                            size = _read<uint8_t>(data);
-                        }
-                    } break;
-                    case 0xF9: // graphic control
-                    {
-                        skip<uint8_t>(data, peek<uint8_t>(data));
-                        if (_read<uint8_t>(data) != 0x00) {
-                            // wrong block terminator
-                            return {};
-                        }
-                    } break;
                     case 0xFE: // comment
-                    {
-                        // read data
-                        auto size = _read<uint8_t>(data);
-                        while (size) {
-                            skip<uint8_t>(data, size);
-                            size = _read<uint8_t>(data);
-                        }
-                    } break;
+                        // the fixed header of plain text and application is just the first sub-block
+                        expect = SUB_BLOCKS;
+                        break;
+                    case 0xF9: // graphic control
+                        head.start(6);
+                        expect = GRAPHIC_CONTROL;
+                        break;
                     default:
-                        return {};
+                        result = PARSE_FAILED;
+                        break;
                 }
             } break;
-            case 0x2C: // image descriptor
+            case SUB_BLOCKS:
             {
-                found_imagedescriptor = true;
-                skip<uint16_t>(data, 4);
-                auto flags = _read<uint8_t>(data);
-                bool local_color_table_flag = (flags >> 7) & 1;
-                int  size_of_local_color_table = flags & 7;
-                // read color table
-                if (local_color_table_flag) {
-                    auto N = 1 << (size_of_local_color_table);
-                    auto S = 3 * N;
-                    skip<uint8_t>(data, S);
-                }
-                // read data
-                skip<uint8_t>(data);
-                auto size = _read<uint8_t>(data);
-                while (size) {
-                    skip<uint8_t>(data, size);
-                    size = _read<uint8_t>(data);
+                const auto size = data[0];
+                data = data.subspan(1);
+                if (size == 0) {
+                    expect = BLOCK;
+                } else {
+                    left = size;
+                    after = SUB_BLOCKS;
+                    expect = SKIP;
                 }
             } break;
-            case 0x3B:
-                if (!found_imagedescriptor) {
-                    return {};
+            case GRAPHIC_CONTROL:
+                // block size, packed fields, delay time, transparent color index, block terminator
+                if (head.take(data)) {
+                    if (head[0] != 0x04 || head[5] != 0x00) {
+                        result = PARSE_FAILED;
+                        break;
+                    }
+                    expect = BLOCK;
+                }
+                break;
+            case DESCRIPTOR:
+                if (head.take(data)) {
+                    result = descriptor();
                 }
-                found_trailer = true;
                 break;
-            default:
-                return {};
+            case MIN_CODE_SIZE:
+            {
+                const auto size = data[0];
+                data = data.subspan(1);
+                if (!strict) {
+                    expect = SUB_BLOCKS;
+                    break;
+                }
+                if (size < 2 || size > 8) {
+                    result = PARSE_FAILED;
+                    break;
+                }
+                start_lzw(size);
+                expect = LZW_SIZE;
+            } break;
+            case LZW_SIZE:
+            {
+                const auto size = data[0];
+                data = data.subspan(1);
+                if (size == 0) {
+                    if (!found_eoi) {
+                        // no EOI
+                        result = PARSE_FAILED;
+                        break;
+                    }
+                    expect = BLOCK;
+                } else {
+                    left = size;
+                    expect = LZW_DATA;
+                }
+            } break;
+            case LZW_DATA:
+            {
+                const auto part = subspan(data, 0, left);
+                if (!lzw(part)) {
+                    result = PARSE_FAILED;
+                    break;
+                }
+                left -= part.size();
+                data = data.subspan(part.size());
+                if (left == 0) {
+                    if (pixels > pixels_max) {
+                        result = PARSE_FAILED;
+                        break;
+                    }
+                    expect = LZW_SIZE;
+                }
+            } break;
         }
     }
+    consumed += available - data.size();
+    return result;
+}
 
-    if (!found_trailer) {
+std::span<const uint8_t> read_gif(std::span<const uint8_t> data, bool strict, image_info* info) {
+    if (!gif_parser::starts(data)) [[likely]] {
         return {};
     }
-
-    auto end = data.data();
-
-    return { start, end };
+    gif_parser parser(strict);
+    if (parser.feed(data) != PARSE_DONE) {
+        return {};
+    }
+    if (info) {
+        *info = parser.info;
+    }
+    return data.first(parser.size());
 }
-
@@ -3,8 +3,68 @@
 
 #include <span>
 #include <cstdint>
+#include <vector>
+#include "image_info.h"
+#include "parser.h"
 
 constexpr uint8_t FIRST_BYTE_GIF = 0x47;
-std::span<const uint8_t> read_gif(std::span<const uint8_t> data);
+// strict additionally checks the LZW stream of every frame and that frames fit the logical screen
+std::span<const uint8_t> read_gif(std::span<const uint8_t> data, bool strict = false, image_info* info = nullptr);
+
+// read_gif as a state machine, see parser.h
+class gif_parser {
+public:
+    explicit gif_parser(bool strict = false) : strict(strict) {}
+    // false if data can't be the start of one, looks at the signature only
+    static bool starts(std::span<const uint8_t> data);
+    PARSE feed(std::span<const uint8_t> data);
+    uint64_t size() const {
+        return consumed;
+    }
+    image_info info;
+
+private:
+    enum EXPECT : uint8_t {
+        HEADER,
+        SKIP,           // color table or sub-block, then after
+        BLOCK,          // introducer
+        LABEL,          // of an extension
+        SUB_BLOCKS,     // size of the next sub-block
+        GRAPHIC_CONTROL,
+        DESCRIPTOR,
+        MIN_CODE_SIZE,
+        LZW_SIZE,       // size of the next sub-block of image data
+        LZW_DATA
+    };
+
+    PARSE header();
+    PARSE descriptor();
+    void start_lzw(uint8_t min_code_size);
+    bool lzw(std::span<const uint8_t> data);
+
+    bool strict;
+    EXPECT expect = HEADER;
+    EXPECT after = BLOCK;
+    uint64_t left = 0;
+    uint16_t screen_width = 0;
+    uint16_t screen_height = 0;
+    uint32_t frames = 0;
+    gather<13> head{ {}, 0, 13 };
+    uint64_t consumed = 0;
+
+    // LZW decoder of the current frame, strict only
+    uint32_t clear = 0;
+    uint32_t eoi = 0;
+    uint32_t next = 0;
+    uint32_t code_size = 0;
+    uint8_t min_code_size = 0;
+    int32_t prev = -1;
+    uint64_t pixels = 0;
+    uint64_t pixels_max = 0;
+    uint32_t bits = 0;
+    uint32_t bit_count = 0;
+    bool found_eoi = false;
+    std::vector<uint16_t> lengths; // allocated by the first frame
+};
 
 #endif
\ No newline at end of file
@@ -0,0 +1,197 @@
+#include "read_ico.h"
+#include "utils.h"
+#include <algorithm>
+
+namespace {
+    template<typename T>
+    T _read(std::span<const uint8_t>& data) {
+        return ::read<T, std::endian::little>(data);
+    }
+
+    // reserved and type
+    constexpr auto SIGNATURE_ICON   = convert<uint32_t, std::endian::native, std::endian::big>(0x00000100);
+    constexpr auto SIGNATURE_CURSOR = convert<uint32_t, std::endian::native, std::endian::big>(0x00000200);
+    constexpr auto SIGNATURE_PNG    = convert<uint64_t, std::endian::native, std::endian::big>(0x89504E470D0A1A0A);
+
+    // real icons have a handful of sizes
+    constexpr uint16_t MAX_IMAGES = 256;
+    // BITMAPINFOHEADER, a png is larger
+    constexpr uint32_t MIN_IMAGE_SIZE = 40;
+}
+
+// based on https://en.wikipedia.org/wiki/ICO_(file_format)
+
+bool ico_parser::starts(std::span<const uint8_t> data) {
+    return starts_with(data, SIGNATURE_ICON) || starts_with(data, SIGNATURE_CURSOR);
+}
+
+PARSE ico_parser::header() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    const auto signature = read<uint32_t>(data);
+    if (signature != SIGNATURE_ICON && signature != SIGNATURE_CURSOR) {
+        return PARSE_FAILED;
+    }
+    count = _read<uint16_t>(data);
+    if (count == 0 || count > MAX_IMAGES) {
+        return PARSE_FAILED;
+    }
+    cursor = signature == SIGNATURE_CURSOR;
+    info.variant = cursor ? "cursor" : "";
+    info.parts = count;
+    head.start(16);
+    expect = ENTRY;
+    return PARSE_MORE;
+}
+
+PARSE ico_parser::directory_entry(uint64_t position) {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    entry e;
+    // 0 is 256
+    e.width = _read<uint8_t>(data);
+    e.height = _read<uint8_t>(data);
+    e.width = e.width ? e.width : 256;
+    e.height = e.height ? e.height : 256;
+    skip<uint8_t>(data); // colors
+    const auto reserved = _read<uint8_t>(data);
+    const auto planes = _read<uint16_t>(data);
+    const auto bits = _read<uint16_t>(data);
+    e.size = _read<uint32_t>(data);
+    e.offset = _read<uint32_t>(data);
+    if (reserved != 0 && reserved != 0xFF) {
+        return PARSE_FAILED;
+    }
+    if (!cursor) {
+        // cursors have their hotspot there
+        if (planes > 1 || (bits != 0 && bits != 1 && bits != 4 && bits != 8 && bits != 16 && bits != 24 && bits != 32)) {
+            return PARSE_FAILED;
+        }
+    }
+    if (e.size < MIN_IMAGE_SIZE || e.offset < 6 + 16 * uint32_t(count)) {
+        return PARSE_FAILED;
+    }
+    entries.push_back(e);
+    if (entries.size() < count) {
+        head.start(16);
+        return PARSE_MORE;
+    }
+
+    // the images follow the directory in any order, without overlapping
+    std::sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) { return a.offset < b.offset; });
+    for (size_t i = 1; i < entries.size(); ++i) {
+        if (uint64_t(entries[i - 1].offset) + entries[i - 1].size > entries[i].offset) {
+            return PARSE_FAILED;
+        }
+    }
+    return next_image(position);
+}
+
+PARSE ico_parser::next_image(uint64_t position) {
+    if (current == entries.size()) {
+        return PARSE_DONE;
+    }
+    left = entries[current].offset - position;
+    expect = SKIP;
+    if (left == 0) {
+        return skipped(position);
+    }
+    return PARSE_MORE;
+}
+
+PARSE ico_parser::skipped(uint64_t position) {
+    if (in_image) {
+        in_image = false;
+        ++current;
+        return next_image(position);
+    }
+    head.start(std::min<uint32_t>(entries[current].size, sizeof(head.bytes)));
+    expect = IMAGE;
+    return PARSE_MORE;
+}
+
+// a png or a BITMAPINFOHEADER with twice the height, the AND mask follows the pixels
+PARSE ico_parser::image(uint64_t position) {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    auto& e = entries[current];
+    if (peek<uint64_t>(data) == SIGNATURE_PNG) {
+        // IHDR is the first chunk
+        if (peek<uint32_t, std::endian::big>(data, 12) != 0x49484452) {
+            return PARSE_FAILED;
+        }
+        e.width = peek<uint32_t, std::endian::big>(data, 16);
+        e.height = peek<uint32_t, std::endian::big>(data, 20);
+    } else {
+        if (_read<uint32_t>(data) != 40) {
+            return PARSE_FAILED;
+        }
+        const auto width = _read<int32_t>(data);
+        const auto height = _read<int32_t>(data);
+        if (width <= 0 || height <= 0 || _read<uint16_t>(data) != 1) {
+            return PARSE_FAILED;
+        }
+        e.width = width;
+        e.height = height / 2;
+    }
+    if (e.width == 0 || e.height == 0) {
+        return PARSE_FAILED;
+    }
+    if (uint64_t(e.width) * e.height > uint64_t(info.width) * info.height) {
+        info.width = e.width;
+        info.height = e.height;
+    }
+    in_image = true;
+    left = e.size - head.have;
+    expect = SKIP;
+    if (left == 0) {
+        return skipped(position);
+    }
+    return PARSE_MORE;
+}
+
+PARSE ico_parser::feed(std::span<const uint8_t> data) {
+    const auto available = data.size();
+    const auto position = [&] {
+        return consumed + (available - data.size());
+    };
+    auto result = PARSE_MORE;
+    while (result == PARSE_MORE && !data.empty()) {
+        switch (expect) {
+            case HEADER:
+                if (head.take(data)) {
+                    result = header();
+                }
+                break;
+            case ENTRY:
+                if (head.take(data)) {
+                    result = directory_entry(position());
+                }
+                break;
+            case SKIP:
+                left = skip_bytes(data, left);
+                if (left == 0) {
+                    result = skipped(position());
+                }
+                break;
+            case IMAGE:
+                if (head.take(data)) {
+                    result = image(position());
+                }
+                break;
+        }
+    }
+    consumed += available - data.size();
+    return result;
+}
+
+std::span<const uint8_t> read_ico(std::span<const uint8_t> data, image_info* info) {
+    if (!ico_parser::starts(data)) [[likely]] {
+        return {};
+    }
+    ico_parser parser;
+    if (parser.feed(data) != PARSE_DONE) {
+        return {};
+    }
+    if (info) {
+        *info = parser.info;
+    }
+    return data.first(parser.size());
+}
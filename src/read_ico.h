@@ -0,0 +1,58 @@
+#ifndef H_READ_ICO
+#define H_READ_ICO
+
+#include <span>
+#include <cstdint>
+#include <vector>
+#include "image_info.h"
+#include "parser.h"
+
+// shared with jp2 and jxl, these are only tried at the start of a sector
+constexpr uint8_t FIRST_BYTE_ICO = 0x00;
+// icons and cursors
+std::span<const uint8_t> read_ico(std::span<const uint8_t> data, image_info* info = nullptr);
+
+// read_ico as a state machine, see parser.h
+class ico_parser {
+public:
+    // false if data can't be the start of one, looks at the signature only
+    static bool starts(std::span<const uint8_t> data);
+    PARSE feed(std::span<const uint8_t> data);
+    uint64_t size() const {
+        return consumed;
+    }
+    image_info info;
+
+private:
+    enum EXPECT : uint8_t {
+        HEADER,
+        ENTRY,      // of the directory
+        SKIP,       // up to the next image
+        IMAGE       // the start of it
+    };
+
+    struct entry {
+        uint32_t offset;
+        uint32_t size;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    PARSE header();
+    PARSE directory_entry(uint64_t position);
+    PARSE next_image(uint64_t position);
+    PARSE skipped(uint64_t position);
+    PARSE image(uint64_t position);
+
+    EXPECT expect = HEADER;
+    uint16_t count = 0;
+    bool cursor = false;
+    uint64_t left = 0;
+    size_t current = 0;         // entry of the next image
+    bool in_image = false;      // skipping the rest of the current one
+    std::vector<entry> entries; // by offset once the directory is read
+    gather<24> head{ {}, 0, 6 };
+    uint64_t consumed = 0;
+};
+
+#endif
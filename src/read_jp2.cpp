@@ -0,0 +1,203 @@
+#include "read_jp2.h"
+#include "utils.h"
+
+namespace {
+    template<typename T>
+    T _read(std::span<const uint8_t>& data) {
+        return ::read<T, std::endian::big>(data);
+    }
+
+    constexpr auto SIGNATURE_LENGTH = convert<uint32_t, std::endian::native, std::endian::big>(0x0000000C);
+    constexpr auto SIGNATURE_TYPE   = convert<uint32_t, std::endian::native, std::endian::big>(0x6A502020);
+    constexpr auto SIGNATURE_DATA   = convert<uint32_t, std::endian::native, std::endian::big>(0x0D0A870A);
+
+    constexpr auto BOX_FTYP = convert<uint32_t, std::endian::native, std::endian::big>(0x66747970);
+    constexpr auto BOX_JP2H = convert<uint32_t, std::endian::native, std::endian::big>(0x6A703268);
+    constexpr auto BOX_IHDR = convert<uint32_t, std::endian::native, std::endian::big>(0x69686472);
+    constexpr auto BOX_JP2C = convert<uint32_t, std::endian::native, std::endian::big>(0x6A703263);
+
+    constexpr auto BRAND_JP2 = convert<uint32_t, std::endian::native, std::endian::big>(0x6A703220);
+    constexpr auto BRAND_JPX = convert<uint32_t, std::endian::native, std::endian::big>(0x6A707820);
+
+    // SOC followed by SIZ
+    constexpr auto CODESTREAM = convert<uint32_t, std::endian::native, std::endian::big>(0xFF4FFF51);
+
+    bool printable(uint32_t type) {
+        const auto bytes = reinterpret_cast<const uint8_t*>(&type);
+        for (int i = 0; i < 4; ++i) {
+            if (bytes[i] < 0x20 || bytes[i] > 0x7E) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+// based on ITU-T T.800 annex I
+
+bool jp2_parser::starts(std::span<const uint8_t> data) {
+    return starts_with(data, SIGNATURE_LENGTH) && starts_with(subspan(data, 4), SIGNATURE_TYPE);
+}
+
+PARSE jp2_parser::signature() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    if (read<uint32_t>(data) != SIGNATURE_LENGTH || read<uint32_t>(data) != SIGNATURE_TYPE || read<uint32_t>(data) != SIGNATURE_DATA) {
+        return PARSE_FAILED;
+    }
+    head.start(8);
+    expect = BOX;
+    return PARSE_MORE;
+}
+
+PARSE jp2_parser::box() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    const auto length = _read<uint32_t>(data);
+    type = read<uint32_t>(data);
+    if (length == 0) {
+        // runs up to the end of the file, which isn't known here
+        return PARSE_FAILED;
+    }
+    if (length == 1) {
+        head.start(8);
+        expect = LARGE;
+        return PARSE_MORE;
+    }
+    left = length;
+    header = 8;
+    return opened();
+}
+
+PARSE jp2_parser::large_box() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    left = _read<uint64_t>(data);
+    header = 16;
+    return opened();
+}
+
+PARSE jp2_parser::opened() {
+    if (left < header || !printable(type)) {
+        return PARSE_FAILED;
+    }
+    left -= header;
+    size_t n = 0;
+    if (!typed) {
+        // the brand
+        if (type != BOX_FTYP) {
+            return PARSE_FAILED;
+        }
+        n = 4;
+    } else if (type == BOX_JP2H) {
+        // the first box inside is ihdr, up to the width
+        n = 16;
+    } else if (type == BOX_JP2C) {
+        n = 4;
+    }
+    if (n > left) {
+        return PARSE_FAILED;
+    }
+    if (n == 0) {
+        expect = SKIP;
+        if (left == 0) {
+            return skipped();
+        }
+        return PARSE_MORE;
+    }
+    head.start(n);
+    expect = CONTENT;
+    return PARSE_MORE;
+}
+
+PARSE jp2_parser::content() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    if (type == BOX_FTYP) {
+        const auto brand = read<uint32_t>(data);
+        if (brand != BRAND_JP2 && brand != BRAND_JPX) {
+            return PARSE_FAILED;
+        }
+        typed = true;
+        info.variant = brand == BRAND_JPX ? "jpx" : "";
+    } else if (type == BOX_JP2H) {
+        skip<uint32_t>(data); // length
+        if (read<uint32_t>(data) != BOX_IHDR) {
+            return PARSE_FAILED;
+        }
+        info.height = _read<uint32_t>(data);
+        info.width = _read<uint32_t>(data);
+        if (info.width == 0 || info.height == 0) {
+            return PARSE_FAILED;
+        }
+        found_header = true;
+    } else if (type == BOX_JP2C) {
+        if (read<uint32_t>(data) != CODESTREAM) {
+            return PARSE_FAILED;
+        }
+        ++info.parts;
+    }
+    left -= head.have;
+    expect = SKIP;
+    if (left == 0) {
+        return skipped();
+    }
+    return PARSE_MORE;
+}
+
+PARSE jp2_parser::skipped() {
+    if (type == BOX_JP2C) {
+        // metadata may follow the codestream, but rarely does
+        return found_header ? PARSE_DONE : PARSE_FAILED;
+    }
+    head.start(8);
+    expect = BOX;
+    return PARSE_MORE;
+}
+
+PARSE jp2_parser::feed(std::span<const uint8_t> data) {
+    const auto available = data.size();
+    auto result = PARSE_MORE;
+    while (result == PARSE_MORE && !data.empty()) {
+        switch (expect) {
+            case SIGNATURE:
+                if (head.take(data)) {
+                    result = signature();
+                }
+                break;
+            case BOX:
+                if (head.take(data)) {
+                    result = box();
+                }
+                break;
+            case LARGE:
+                if (head.take(data)) {
+                    result = large_box();
+                }
+                break;
+            case CONTENT:
+                if (head.take(data)) {
+                    result = content();
+                }
+                break;
+            case SKIP:
+                left = skip_bytes(data, left);
+                if (left == 0) {
+                    result = skipped();
+                }
+                break;
+        }
+    }
+    consumed += available - data.size();
+    return result;
+}
+
+std::span<const uint8_t> read_jp2(std::span<const uint8_t> data, image_info* info) {
+    if (!jp2_parser::starts(data)) [[likely]] {
+        return {};
+    }
+    jp2_parser parser;
+    if (parser.feed(data) != PARSE_DONE) {
+        return {};
+    }
+    if (info) {
+        *info = parser.info;
+    }
+    return data.first(parser.size());
+}
@@ -0,0 +1,51 @@
+#ifndef H_READ_JP2
+#define H_READ_JP2
+
+#include <span>
+#include <cstdint>
+#include "image_info.h"
+#include "parser.h"
+
+// shared with ico and jxl
+constexpr uint8_t FIRST_BYTE_JP2 = 0x00;
+// jpeg 2000 in the jp2 or jpx file format, not bare codestreams
+std::span<const uint8_t> read_jp2(std::span<const uint8_t> data, image_info* info = nullptr);
+
+// read_jp2 as a state machine, see parser.h
+class jp2_parser {
+public:
+    // false if data can't be the start of one, looks at the signature only
+    static bool starts(std::span<const uint8_t> data);
+    PARSE feed(std::span<const uint8_t> data);
+    uint64_t size() const {
+        return consumed;
+    }
+    image_info info;
+
+private:
+    enum EXPECT : uint8_t {
+        SIGNATURE,  // the signature box
+        BOX,        // length and type
+        LARGE,      // 64 bit length
+        CONTENT,    // the start of the content that is checked
+        SKIP        // the rest of the box
+    };
+
+    PARSE signature();
+    PARSE box();
+    PARSE large_box();
+    PARSE opened();
+    PARSE content();
+    PARSE skipped();
+
+    EXPECT expect = SIGNATURE;
+    uint32_t type = 0;
+    uint64_t left = 0;
+    uint64_t header = 0;        // bytes of the box header
+    bool typed = false;         // after ftyp
+    bool found_header = false;  // after jp2h
+    gather<16> head{ {}, 0, 12 };
+    uint64_t consumed = 0;
+};
+
+#endif
@@ -1,139 +1,274 @@
 #include "read_jpg.h"
 #include "utils.h"
+#include <array>
+#include <cstring>
 
 namespace {
-    uint16_t read(std::span<const uint8_t>& data) {
-        return ::read<uint16_t, std::endian::big>(data);
+    // SOI in big-endian
+    constexpr auto SIGNATURE = convert<uint16_t, std::endian::native, std::endian::big>(0xFFD8);
+
+    enum MARKER_CLASS : uint8_t {
+        INVALID,
+        STUFFED,    // 0xFF00 inside of entropy coded data
+        SOI,
+        EOI,
+        RST,
+        SOF,
+        SOS,
+        DHT,
+        DQT,
+        DAC,
+        DRI,
+        DNL,
+        SEGMENT     // anything else with a length, skipped
+    };
+
+    // based on https://en.wikipedia.org/wiki/JPEG_File_Interchange_Format
+    // and https://dev.exiv2.org/projects/exiv2/wiki/The_Metadata_in_JPEG_files
+    // and https://www.w3.org/Graphics/JPEG/itu-t81.pdf table B.1
+    constexpr auto MARKER_CLASSES = [] {
+        std::array<MARKER_CLASS, 256> table{};
+        table[0x00] = STUFFED;
+        for (auto m = 0xC0; m <= 0xCF; ++m) {
+            table[m] = SOF;
+        }
+        table[0xC4] = DHT;
+        table[0xC8] = SEGMENT; // JPG reserved
+        table[0xCC] = DAC;
+        for (auto m = 0xD0; m <= 0xD7; ++m) {
+            table[m] = RST;
+        }
+        table[0xD8] = SOI;
+        table[0xD9] = EOI;
+        table[0xDA] = SOS;
+        table[0xDB] = DQT;
+        table[0xDC] = DNL;
+        table[0xDD] = DRI;
+        table[0xDE] = SEGMENT; // DHP
+        table[0xDF] = SEGMENT; // EXP
+        for (auto m = 0xE0; m <= 0xEF; ++m) {
+            table[m] = SEGMENT; // APPn
+        }
+        table[0xFE] = SEGMENT; // COM
+        return table;
+    }();
+
+    const char* variant(uint8_t sof) {
+        switch (sof) {
+            case 0xC0: return "baseline";
+            case 0xC1: return "extended";
+            case 0xC2: return "progressive";
+            case 0xC3: return "lossless";
+            case 0xC5: return "differential-extended";
+            case 0xC6: return "differential-progressive";
+            case 0xC7: return "differential-lossless";
+            case 0xC9: return "extended-arithmetic";
+            case 0xCA: return "progressive-arithmetic";
+            case 0xCB: return "lossless-arithmetic";
+            case 0xCD: return "differential-extended-arithmetic";
+            case 0xCE: return "differential-progressive-arithmetic";
+            case 0xCF: return "differential-lossless-arithmetic";
+        }
+        return nullptr;
     }
-    uint16_t peek(const std::span<const uint8_t> data) {
-        return ::peek<uint16_t, std::endian::big>(data);
+
+    bool lossless(uint8_t sof) {
+        return (sof & 3) == 3;
     }
+}
 
-    // SOI in big-endian
-    constexpr auto SIGNATURE = convert<uint16_t, std::endian::native, std::endian::big>(0xFFD8);
+bool jpg_parser::starts(std::span<const uint8_t> data) {
+    return starts_with(data, SIGNATURE);
 }
 
-std::span<const uint8_t> read_jpg(std::span<const uint8_t> data) {
-    if (peek<decltype(SIGNATURE)>(data) != SIGNATURE) [[likely]] {
-        return {};
+PARSE jpg_parser::marker(uint8_t marker) {
+    code = marker;
+    const auto marker_class = MARKER_CLASSES[marker];
+    if (marker_class == EOI) {
+        if (
+            state == HEADER ||
+            !(found_dht || found_dac) ||
+            !(found_dqt || lossless(sof)) ||
+            height == 0
+        ) {
+            return PARSE_FAILED;
+        }
+        info.width = width;
+        info.height = height;
+        info.variant = variant(sof);
+        info.parts = scans;
+        return PARSE_DONE;
+    }
+    if (marker_class == INVALID || marker_class == STUFFED || marker_class == SOI || marker_class == RST) {
+        // RST and 0xFF00 are handled inside of SCAN
+        return PARSE_FAILED;
     }
 
-    const auto start = data.data();
+    // everything left has a length
+    head.start(2);
+    expect = LENGTH;
+    return PARSE_MORE;
+}
 
-    // based on https://en.wikipedia.org/wiki/JPEG_File_Interchange_Format
-    // and https://dev.exiv2.org/projects/exiv2/wiki/The_Metadata_in_JPEG_files
+// the segment starts in head, left bytes of it follow
+PARSE jpg_parser::segment() {
+    const size_t size = length - 2;
+    switch (MARKER_CLASSES[code]) {
+        case SOF:
+        {
+            if (state != HEADER || sof) {
+                return PARSE_FAILED;
+            }
+            const auto components = size >= 6 ? head[5] : 0;
+            if (components == 0 || components > 4 || size != 6u + 3 * components) {
+                return PARSE_FAILED;
+            }
+            sof = code;
+            height = (head[1] << 8) | head[2];
+            width = (head[3] << 8) | head[4];
+            if (width == 0) {
+                return PARSE_FAILED;
+            }
+        } break;
+        case SOS:
+        {
+            if (!sof) {
+                return PARSE_FAILED;
+            }
+            const auto components = size == 0 ? 0 : head[0];
+            if (components == 0 || components > 4 || size != 4u + 2 * components) {
+                return PARSE_FAILED;
+            }
+            ++scans;
+            state = SCAN;
+        } break;
+        case DNL:
+            // defines the height after the first scan
+            if (state != BETWEEN_SCANS || scans != 1 || height != 0 || size != 2) {
+                return PARSE_FAILED;
+            }
+            height = (head[0] << 8) | head[1];
+            break;
+        case DRI:
+            if (size != 2) {
+                return PARSE_FAILED;
+            }
+            break;
+        case DHT:
+            found_dht = true;
+            break;
+        case DQT:
+            found_dqt = true;
+            break;
+        case DAC:
+            found_dac = true;
+            break;
+        default:
+            // APPn, COM, ..
+            break;
+    }
+    expect = left ? SKIP : state == SCAN ? ENTROPY : MARKER;
+    return PARSE_MORE;
+}
 
-    bool found_dht = false;
-    bool found_dqt = false;
-    bool found_sos = false;
-    bool found_eoi = false;
-    bool found_soi = false;
-    bool found_dac = false;
-    while (!found_eoi && !data.empty()) {
-        auto before_read = data;
-        switch (read(data)) {
-            case 0xFF00: // stuffed 0xFF in SOS
-                if (!found_sos) {
-                    return {};
+PARSE jpg_parser::feed(std::span<const uint8_t> data) {
+    const auto available = data.size();
+    auto result = PARSE_MORE;
+    while (result == PARSE_MORE && !data.empty()) {
+        switch (expect) {
+            case MAGIC:
+                if (head.take(data)) {
+                    if (head[0] != 0xFF || head[1] != 0xD8) [[likely]] {
+                        result = PARSE_FAILED;
+                    }
+                    expect = MARKER;
                 }
                 break;
-            case 0xFFE0: // APP0
-            case 0xFFE1: // APP1 exif
-            case 0xFFE2: // APP2
-            case 0xFFE3: // APP3
-            case 0xFFE4: // APP4
-            case 0xFFE5: // APP5
-            case 0xFFE6: // APP6
-            case 0xFFE7: // APP7
-            case 0xFFE8: // APP8
-            case 0xFFE9: // APP9
-            case 0xFFEA: // APP10
-            case 0xFFEB: // APP11
-            case 0xFFEC: // APP12
-            case 0xFFED: // APP13
-            case 0xFFEE: // APP14
-            case 0xFFEF: // APP15
-            case 0xFFC0: // SOF0
-            case 0xFFC1: // SOF1
-            case 0xFFC2: // SOF2
-            case 0xFFC3: // SOF3
-            case 0xFFC5: // SOF5
-            case 0xFFC6: // SOF6
-            case 0xFFC7: // SOF7
-            case 0xFFC8: // JPG reserved
-            case 0xFFC9: // SOF9
-            case 0xFFCA: // SOF10
-            case 0xFFCB: // SOF11
-            case 0xFFCD: // SOF13
-            case 0xFFCE: // SOF14
-            case 0xFFCF: // SOF15
-            case 0xFFFE: // COM
-                skip<uint8_t>(data, peek(data));
-                break;
-            case 0xFFDD: // DRI
-                skip<uint16_t>(data);
-                break;
-            case 0xFFD0: // RST0
-            case 0xFFD1: // RST1
-            case 0xFFD2: // RST2
-            case 0xFFD3: // RST3
-            case 0xFFD4: // RST4
-            case 0xFFD5: // RST5
-            case 0xFFD6: // RST6
-            case 0xFFD7: // RST7
-                if (!found_sos) {
-                    return {};
+            case MARKER:
+                if (data[0] != 0xFF) {
+                    result = PARSE_FAILED;
+                    break;
                 }
+                data = data.subspan(1);
+                expect = MARKER_CODE;
                 break;
-            case 0xFFD8: // SOI
-                if (found_soi) {
-                    return {};
+            case MARKER_CODE:
+            {
+                // any marker may be preceded by fill bytes
+                const auto byte = data[0];
+                data = data.subspan(1);
+                if (byte != 0xFF) {
+                    result = marker(byte);
                 }
-                found_soi = true;
-                break;
-            case 0xFFC4: // DHT
-                found_dht = true;
-                skip<uint8_t>(data, peek(data));
-                break;
-            case 0xFFDB: // DQT
-                found_dqt = true;
-                skip<uint8_t>(data, peek(data));
-                break;
-            case 0xFFCC: // DAC
-                found_dac = true;
-                skip<uint8_t>(data, peek(data));
-                break;
-            case 0xFFD9: // EOI
-                if (
-                    !found_sos ||
-                    !(found_dht || found_dac) ||
-                    !found_dqt
-                ) {
-                    return {};
+            } break;
+            case LENGTH:
+                if (head.take(data)) {
+                    length = (head[0] << 8) | head[1];
+                    if (length < 2) {
+                        result = PARSE_FAILED;
+                        break;
+                    }
+                    head.start(std::min(length - 2, 6));
+                    left = length - 2 - head.want;
+                    expect = SEGMENT;
+                    if (head.want == 0) {
+                        result = segment();
+                    }
                 }
-                found_eoi = true;
                 break;
-            case 0xFFDA: // SOS
-                if (found_sos) {
-                    return {};
+            case SEGMENT:
+                if (head.take(data)) {
+                    result = segment();
                 }
-                found_sos = true;
                 break;
-            default:
-                if (!found_sos) {
-                    return {};
+            case SKIP:
+                left = skip_bytes(data, left);
+                if (left == 0) {
+                    expect = state == SCAN ? ENTROPY : MARKER;
                 }
-                // seek back by 1 byte
-                data = subspan(before_read, 1);
                 break;
+            case ENTROPY:
+            {
+                // only 0xFF can start a marker, everything else is entropy coded data
+                const auto p = static_cast<const uint8_t*>(std::memchr(data.data(), 0xFF, data.size()));
+                fuzz_count(p ? p - data.data() + 1 : data.size());
+                if (!p) {
+                    data = {};
+                    break;
+                }
+                data = data.subspan(p - data.data() + 1);
+                expect = ENTROPY_FF;
+            } break;
+            case ENTROPY_FF:
+            {
+                const auto byte = data[0];
+                data = data.subspan(1);
+                fuzz_count(1);
+                const auto next = MARKER_CLASSES[byte];
+                if (next == STUFFED || next == RST) {
+                    expect = ENTROPY;
+                } else if (byte != 0xFF) {
+                    // 0xFF is a fill byte, the next one may start the marker
+                    state = BETWEEN_SCANS;
+                    result = marker(byte);
+                }
+            } break;
         }
     }
+    consumed += available - data.size();
+    return result;
+}
 
-    if (!found_eoi) {
+std::span<const uint8_t> read_jpg(std::span<const uint8_t> data, image_info* info) {
+    if (!jpg_parser::starts(data)) [[likely]] {
         return {};
     }
-
-    const auto end = data.data();
-
-    return { start, end };
-}
\ No newline at end of file
+    jpg_parser parser;
+    if (parser.feed(data) != PARSE_DONE) {
+        return {};
+    }
+    if (info) {
+        *info = parser.info;
+    }
+    return data.first(parser.size());
+}
@@ -3,8 +3,59 @@
 
 #include <span>
 #include <cstdint>
+#include "image_info.h"
+#include "parser.h"
 
 constexpr uint8_t FIRST_BYTE_JPG = 0xFF;
-std::span<const uint8_t> read_jpg(std::span<const uint8_t> data);
+std::span<const uint8_t> read_jpg(std::span<const uint8_t> data, image_info* info = nullptr);
 
-#endif
\ No newline at end of file
+// read_jpg as a state machine, see parser.h
+class jpg_parser {
+public:
+    // false if data can't be the start of one, looks at the signature only
+    static bool starts(std::span<const uint8_t> data);
+    PARSE feed(std::span<const uint8_t> data);
+    uint64_t size() const {
+        return consumed;
+    }
+    image_info info;
+
+private:
+    // what the next byte is
+    enum EXPECT : uint8_t {
+        MAGIC,
+        MARKER,
+        MARKER_CODE,    // after 0xFF, more 0xFF are fill bytes
+        LENGTH,
+        SEGMENT,        // the start of a segment, enough for the checks
+        SKIP,           // the rest of the segment
+        ENTROPY,
+        ENTROPY_FF
+    };
+    // where in the file
+    enum STATE : uint8_t {
+        HEADER,         // before the first SOS
+        SCAN,           // entropy coded data
+        BETWEEN_SCANS   // tables, DNL, next SOS or EOI
+    };
+
+    PARSE marker(uint8_t code);
+    PARSE segment();
+
+    EXPECT expect = MAGIC;
+    STATE state = HEADER;
+    uint8_t code = 0;
+    uint8_t sof = 0;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    uint16_t length = 0;
+    uint16_t left = 0;
+    uint32_t scans = 0;
+    bool found_dht = false;
+    bool found_dqt = false;
+    bool found_dac = false;
+    gather<6> head{ {}, 0, 2 };
+    uint64_t consumed = 0;
+};
+
+#endif
@@ -0,0 +1,239 @@
+#include "read_jxl.h"
+#include "utils.h"
+
+namespace {
+    template<typename T>
+    T _read(std::span<const uint8_t>& data) {
+        return ::read<T, std::endian::big>(data);
+    }
+
+    constexpr auto SIGNATURE_LENGTH = convert<uint32_t, std::endian::native, std::endian::big>(0x0000000C);
+    constexpr auto SIGNATURE_TYPE   = convert<uint32_t, std::endian::native, std::endian::big>(0x4A584C20);
+    constexpr auto SIGNATURE_DATA   = convert<uint32_t, std::endian::native, std::endian::big>(0x0D0A870A);
+
+    constexpr auto BOX_FTYP = convert<uint32_t, std::endian::native, std::endian::big>(0x66747970);
+    // the whole codestream
+    constexpr auto BOX_JXLC = convert<uint32_t, std::endian::native, std::endian::big>(0x6A786C63);
+    // a part of it, after a 4 byte index
+    constexpr auto BOX_JXLP = convert<uint32_t, std::endian::native, std::endian::big>(0x6A786C70);
+
+    constexpr auto BRAND_JXL = convert<uint32_t, std::endian::native, std::endian::big>(0x6A786C20);
+
+    constexpr uint16_t CODESTREAM = 0xFF0A;
+    // the signature and the longest SizeHeader
+    constexpr size_t CODESTREAM_HEAD = 2 + 9;
+
+    bool printable(uint32_t type) {
+        const auto bytes = reinterpret_cast<const uint8_t*>(&type);
+        for (int i = 0; i < 4; ++i) {
+            if (bytes[i] < 0x20 || bytes[i] > 0x7E) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // least significant bit first
+    struct bit_reader {
+        std::span<const uint8_t> data;
+        size_t position = 0;
+
+        uint32_t bits(int n) {
+            uint32_t value = 0;
+            for (int i = 0; i < n; ++i, ++position) {
+                value |= uint32_t((data[position / 8] >> (position % 8)) & 1) << i;
+            }
+            return value;
+        }
+
+        // U32(1 + u(9), 1 + u(13), 1 + u(18), 1 + u(30))
+        uint32_t dimension() {
+            constexpr int BITS[] = { 9, 13, 18, 30 };
+            return 1 + bits(BITS[bits(2)]);
+        }
+    };
+}
+
+// based on ISO/IEC 18181-1 and 18181-2
+
+bool jxl_parser::starts(std::span<const uint8_t> data) {
+    return starts_with(data, SIGNATURE_LENGTH) && starts_with(subspan(data, 4), SIGNATURE_TYPE);
+}
+
+PARSE jxl_parser::signature() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    if (read<uint32_t>(data) != SIGNATURE_LENGTH || read<uint32_t>(data) != SIGNATURE_TYPE || read<uint32_t>(data) != SIGNATURE_DATA) {
+        return PARSE_FAILED;
+    }
+    head.start(8);
+    expect = BOX;
+    return PARSE_MORE;
+}
+
+PARSE jxl_parser::box() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    const auto length = _read<uint32_t>(data);
+    type = read<uint32_t>(data);
+    if (length == 0) {
+        // runs up to the end of the file, which isn't known here
+        return PARSE_FAILED;
+    }
+    if (length == 1) {
+        head.start(8);
+        expect = LARGE;
+        return PARSE_MORE;
+    }
+    left = length;
+    header = 8;
+    return opened();
+}
+
+PARSE jxl_parser::large_box() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    left = _read<uint64_t>(data);
+    header = 16;
+    return opened();
+}
+
+PARSE jxl_parser::opened() {
+    if (left < header || !printable(type)) {
+        return PARSE_FAILED;
+    }
+    left -= header;
+    size_t n = 0;
+    if (!typed) {
+        // the brand
+        if (type != BOX_FTYP) {
+            return PARSE_FAILED;
+        }
+        n = 4;
+    } else if (type == BOX_JXLC) {
+        n = CODESTREAM_HEAD;
+        last = true;
+    } else if (type == BOX_JXLP) {
+        n = found_size ? 4 : 4 + CODESTREAM_HEAD;
+    }
+    if (n > left) {
+        return PARSE_FAILED;
+    }
+    if (n == 0) {
+        expect = SKIP;
+        if (left == 0) {
+            return skipped();
+        }
+        return PARSE_MORE;
+    }
+    head.start(n);
+    expect = CONTENT;
+    return PARSE_MORE;
+}
+
+PARSE jxl_parser::content() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    if (type == BOX_FTYP) {
+        if (read<uint32_t>(data) != BRAND_JXL) {
+            return PARSE_FAILED;
+        }
+        typed = true;
+    } else if (type == BOX_JXLP) {
+        const auto index = _read<uint32_t>(data);
+        last = index & 0x80000000;
+        info.variant = "partial";
+        ++info.parts;
+    }
+    if (!found_size && (type == BOX_JXLC || type == BOX_JXLP)) {
+        const auto result = size_header(data);
+        if (result != PARSE_MORE) {
+            return result;
+        }
+    }
+    left -= head.have;
+    expect = SKIP;
+    if (left == 0) {
+        return skipped();
+    }
+    return PARSE_MORE;
+}
+
+PARSE jxl_parser::size_header(std::span<const uint8_t> data) {
+    if (_read<uint16_t>(data) != CODESTREAM) {
+        return PARSE_FAILED;
+    }
+    bit_reader bits{ data };
+    const bool small = bits.bits(1);
+    const auto height = small ? (bits.bits(5) + 1) * 8 : bits.dimension();
+    const auto ratio = bits.bits(3);
+    // width by height
+    constexpr uint32_t RATIOS[8][2] = { { 0, 0 }, { 1, 1 }, { 12, 10 }, { 4, 3 }, { 3, 2 }, { 16, 9 }, { 5, 4 }, { 2, 1 } };
+    uint32_t width = 0;
+    if (ratio == 0) {
+        width = small ? (bits.bits(5) + 1) * 8 : bits.dimension();
+    } else {
+        width = uint64_t(height) * RATIOS[ratio][0] / RATIOS[ratio][1];
+    }
+    info.width = width;
+    info.height = height;
+    found_size = true;
+    return PARSE_MORE;
+}
+
+PARSE jxl_parser::skipped() {
+    if (last) {
+        // metadata may follow the codestream, but rarely does
+        return found_size ? PARSE_DONE : PARSE_FAILED;
+    }
+    head.start(8);
+    expect = BOX;
+    return PARSE_MORE;
+}
+
+PARSE jxl_parser::feed(std::span<const uint8_t> data) {
+    const auto available = data.size();
+    auto result = PARSE_MORE;
+    while (result == PARSE_MORE && !data.empty()) {
+        switch (expect) {
+            case SIGNATURE:
+                if (head.take(data)) {
+                    result = signature();
+                }
+                break;
+            case BOX:
+                if (head.take(data)) {
+                    result = box();
+                }
+                break;
+            case LARGE:
+                if (head.take(data)) {
+                    result = large_box();
+                }
+                break;
+            case CONTENT:
+                if (head.take(data)) {
+                    result = content();
+                }
+                break;
+            case SKIP:
+                left = skip_bytes(data, left);
+                if (left == 0) {
+                    result = skipped();
+                }
+                break;
+        }
+    }
+    consumed += available - data.size();
+    return result;
+}
+
+std::span<const uint8_t> read_jxl(std::span<const uint8_t> data, image_info* info) {
+    if (!jxl_parser::starts(data)) [[likely]] {
+        return {};
+    }
+    jxl_parser parser;
+    if (parser.feed(data) != PARSE_DONE) {
+        return {};
+    }
+    if (info) {
+        *info = parser.info;
+    }
+    return data.first(parser.size());
+}
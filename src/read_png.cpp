@@ -1,128 +1,361 @@
 #include "read_png.h"
 #include "utils.h"
 #include <cctype>
+#define ZLIB_CONST
+#include <zlib.h>
 
 namespace {
     uint32_t read(std::span<const uint8_t>& data) {
         return ::read<uint32_t, std::endian::big>(data);
     }
 
-    // https://www.w3.org/TR/PNG-CRCAppendix.html
+    struct png_header {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint8_t  bit_depth = 0;
+        uint8_t  color_type = 0;
+        uint8_t  interlace = 0;
+    };
 
-    uint32_t crc32_table[256];
+    size_t channels(uint8_t color_type) {
+        switch (color_type) {
+            case 0: return 1; // grayscale
+            case 2: return 3; // truecolor
+            case 3: return 1; // indexed
+            case 4: return 2; // grayscale with alpha
+            case 6: return 4; // truecolor with alpha
+        }
+        return 0;
+    }
 
-    void make_crc32_table(void)
-    {
-        uint32_t c;
-        int n, k;
-
-        for (n = 0; n < 256; n++) {
-            c = (uint32_t) n;
-            for (k = 0; k < 8; k++) {
-                if (c & 1)
-                c = 0xedb88320 ^ (c >> 1);
-                else
-                c = c >> 1;
-            }
-            crc32_table[n] = c;
+    bool valid_bit_depth(uint8_t color_type, uint8_t bit_depth) {
+        switch (color_type) {
+            case 0: return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8 || bit_depth == 16;
+            case 3: return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8;
+            case 2:
+            case 4:
+            case 6: return bit_depth == 8 || bit_depth == 16;
         }
+        return false;
     }
 
-    uint32_t update_crc32(uint32_t crc, const uint8_t* buf, int len)
-    {
-        uint32_t c = crc;
-        int n;
+    // walks the filtered scanlines while the inflated data streams by
+    // only the filter type byte at the start of each row is checked
+    class scanlines {
+    public:
+        explicit scanlines(const png_header& ihdr) : ihdr(ihdr) {
+            pass = ihdr.interlace ? 0 : 6;
+            next_pass();
+        }
+
+        // expected size of the whole inflated stream
+        uint64_t total() const {
+            uint64_t sum = 0;
+            for (int p = ihdr.interlace ? 0 : 6; p < 7; ++p) {
+                const auto [w, h] = pass_size(p);
+                if (w && h) {
+                    sum += h * (1 + row_bytes(w));
+                }
+            }
+            return sum;
+        }
 
-        static bool crc32_table_computed = false;
-        if (!crc32_table_computed) [[unlikely]] {
-            make_crc32_table();
-            crc32_table_computed = true;
+        bool feed(const uint8_t* buf, size_t len) {
+            while (len) {
+                if (rows_left == 0) {
+                    // more data than IHDR allows
+                    return false;
+                }
+                if (row_left == 0) {
+                    if (*buf > 4) {
+                        // unknown filter type
+                        return false;
+                    }
+                    row_left = row_size;
+                    ++buf;
+                    --len;
+                    continue;
+                }
+                const auto n = std::min<uint64_t>(len, row_left);
+                buf += n;
+                len -= n;
+                row_left -= n;
+                if (row_left == 0 && --rows_left == 0) {
+                    ++pass;
+                    next_pass();
+                }
+            }
+            return true;
         }
-        for (n = 0; n < len; n++) {
-            c = crc32_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+
+    private:
+        // https://www.w3.org/TR/png/#8Interlace
+        std::pair<uint64_t, uint64_t> pass_size(int p) const {
+            constexpr uint8_t x0[] = { 0, 4, 0, 2, 0, 1, 0 };
+            constexpr uint8_t y0[] = { 0, 0, 4, 0, 2, 0, 1 };
+            constexpr uint8_t dx[] = { 8, 8, 4, 4, 2, 2, 1 };
+            constexpr uint8_t dy[] = { 8, 8, 8, 4, 4, 2, 2 };
+            if (!ihdr.interlace) {
+                return { ihdr.width, ihdr.height };
+            }
+            return {
+                (uint64_t(ihdr.width)  + dx[p] - x0[p] - 1) / dx[p],
+                (uint64_t(ihdr.height) + dy[p] - y0[p] - 1) / dy[p]
+            };
         }
-        return c;
-    }
 
-    uint32_t crc32(const uint8_t* buf, int len)
-    {
-        return update_crc32(0xffffffff, buf, len) ^ 0xffffffff;
-    }
+        uint64_t row_bytes(uint64_t w) const {
+            return (w * channels(ihdr.color_type) * ihdr.bit_depth + 7) / 8;
+        }
+
+        void next_pass() {
+            // empty passes have no filter bytes at all
+            for (; pass < 7; ++pass) {
+                const auto [w, h] = pass_size(pass);
+                if (w && h) {
+                    row_size = row_bytes(w);
+                    rows_left = h;
+                    row_left = 0;
+                    return;
+                }
+            }
+            rows_left = 0;
+        }
+
+        png_header ihdr;
+        int pass = 0;
+        uint64_t row_size = 0;
+        uint64_t row_left = 0;
+        uint64_t rows_left = 0;
+    };
 
     // SOI in big-endian
     constexpr auto SIGNATURE = convert<uint64_t, std::endian::native, std::endian::big>(0x89504E470D0A1A0A);
 }
 
-std::span<const uint8_t> read_png(std::span<const uint8_t> data) {
-    if (peek<decltype(SIGNATURE)>(data) != SIGNATURE) [[likely]] {
-        return {};
-    }
+// based on https://en.wikipedia.org/wiki/PNG
 
-    const auto start = data.data();
+bool png_parser::starts(std::span<const uint8_t> data) {
+    return starts_with(data, SIGNATURE);
+}
 
-    // based on https://en.wikipedia.org/wiki/PNG
+PARSE png_parser::chunk() {
+    length = peek<uint32_t, std::endian::big>(std::span(head.bytes), 0);
+    type = peek<uint32_t, std::endian::big>(std::span(head.bytes), 4);
+    crc = crc32_z(0, head.bytes + 4, 4);
+    switch (type) {
+        case 0x49484452: // IHDR
+            if (found_ihdr) {
+                return PARSE_FAILED;
+            }
+            found_ihdr = true;
+            ihdr.start(std::min<uint32_t>(length, sizeof(ihdr.bytes)));
+            break;
+        case 0x49444154: // IDAT
+            if (!found_ihdr) {
+                return PARSE_FAILED;
+            }
+            found_idat = true;
+            break;
+        case 0x49454E44: // IEND
+            if (
+                !found_ihdr ||
+                !found_idat
+            ) {
+                return PARSE_FAILED;
+            }
+            break;
+        case 0x504C5445: // PLTE
+            if (!found_ihdr) {
+                return PARSE_FAILED;
+            }
+            // not always required
+            break;
+        case 0x6163544C: // acTL, APNG
+            if (!found_ihdr) {
+                return PARSE_FAILED;
+            }
+            animated = true;
+            break;
+        default:
+            if (!found_ihdr) {
+                return PARSE_FAILED;
+            }
+            if (!std::islower(type >> 24)) {
+                return PARSE_FAILED;
+            }
+            break;
+    }
+    left = length;
+    expect = DATA;
+    return PARSE_MORE;
+}
 
-    skip<decltype(SIGNATURE)>(data);
+PARSE png_parser::end() {
+    // check crc
+    if (peek<uint32_t, std::endian::big>(std::span(head.bytes)) != crc) {
+        return PARSE_FAILED;
+    }
+    if (type == 0x49484452) { // IHDR
+        const auto fields = std::span<const uint8_t>(ihdr.bytes, ihdr.have);
+        info.width = peek<uint32_t, std::endian::big>(fields, 0);
+        info.height = peek<uint32_t, std::endian::big>(fields, 4);
+        info.variant = peek<uint8_t>(fields, 12) == 1 ? "interlaced" : "";
+    }
+    if (type == 0x49454E44) { // IEND
+        if (animated) {
+            info.variant = "apng";
+        }
+        return PARSE_DONE;
+    }
+    head.start(8);
+    expect = CHUNK;
+    return PARSE_MORE;
+}
 
-    bool found_ihdr = false;
-    bool found_idat = false;
-    bool found_iend = false;
-    while (!found_iend && !data.empty()) {
-        const auto length = read(data);
-        const auto crcdata = subspan(data, 0, sizeof(uint32_t) + length);
-        const auto type = read(data);
-        data = subspan(data, length);
-        const auto crc = read(data);
-        switch (type) {
-            case 0x49484452: // IHDR
-                if (found_ihdr) {
-                    return {};
+PARSE png_parser::feed(std::span<const uint8_t> data) {
+    const auto available = data.size();
+    auto result = PARSE_MORE;
+    while (result == PARSE_MORE && !data.empty()) {
+        switch (expect) {
+            case MAGIC:
+                if (head.take(data)) {
+                    if (peek<decltype(SIGNATURE)>(std::span(head.bytes)) != SIGNATURE) {
+                        result = PARSE_FAILED;
+                        break;
+                    }
+                    head.start(8);
+                    expect = CHUNK;
                 }
-                found_ihdr = true;
                 break;
-            case 0x49444154: // IDAT
-                if (!found_ihdr) {
-                    return {};
+            case CHUNK:
+                if (head.take(data)) {
+                    result = chunk();
                 }
-                found_idat = true;
                 break;
-            case 0x49454E44: // IEND
-                if (
-                    !found_ihdr ||
-                    !found_idat
-                ) {
-                    return {};
+            case DATA:
+            {
+                const auto part = subspan(data, 0, left);
+                if (ihdr.have < ihdr.want) {
+                    auto copy = part;
+                    ihdr.take(copy);
                 }
-                found_iend = true;
-                break;
-            case 0x504C5445: // PLTE
-                if (!found_ihdr) {
-                    return {};
+                crc = crc32_z(crc, part.data(), part.size());
+                fuzz_count(part.size());
+                left -= part.size();
+                data = data.subspan(part.size());
+                if (left == 0) {
+                    head.start(4);
+                    expect = CRC;
                 }
-                // not always required
-                break;
-            default:
-                if (!found_ihdr) {
-                    return {};
-                }
-                if (!std::islower(type >> 24)) {
-                    return {};
+            } break;
+            case CRC:
+                if (head.take(data)) {
+                    result = end();
                 }
                 break;
         }
-        // check crc
-        uint32_t crc_calculated = crc32(crcdata.data(), crcdata.size());
-        if (crc != crc_calculated) {
-            return {};
-        }
     }
+    consumed += available - data.size();
+    return result;
+}
 
-    if (!found_iend) {
+std::span<const uint8_t> read_png(std::span<const uint8_t> data, image_info* info) {
+    if (!png_parser::starts(data)) [[likely]] {
+        return {};
+    }
+    png_parser parser;
+    if (parser.feed(data) != PARSE_DONE) {
         return {};
     }
+    if (info) {
+        *info = parser.info;
+    }
+    return data.first(parser.size());
+}
 
-    const auto end = data.data();
+bool check_png_data(std::span<const uint8_t> data) {
+    skip<decltype(SIGNATURE)>(data);
 
-    return { start, end };
-}
+    // IHDR is always the first chunk, read_png made sure of that
+    png_header ihdr;
+    {
+        auto chunk = subspan(data, 2 * sizeof(uint32_t), 13);
+        ihdr.width = read(chunk);
+        ihdr.height = read(chunk);
+        ihdr.bit_depth = ::read<uint8_t>(chunk);
+        ihdr.color_type = ::read<uint8_t>(chunk);
+        const auto compression = ::read<uint8_t>(chunk);
+        const auto filter = ::read<uint8_t>(chunk);
+        ihdr.interlace = ::read<uint8_t>(chunk);
+        if (
+            ihdr.width == 0 || ihdr.height == 0 ||
+            !valid_bit_depth(ihdr.color_type, ihdr.bit_depth) ||
+            compression != 0 || filter != 0 || ihdr.interlace > 1
+        ) {
+            return false;
+        }
+    }
+
+    scanlines rows(ihdr);
+    const auto expected = rows.total();
 
+    z_stream stream{};
+    if (inflateInit(&stream) != Z_OK) {
+        return false;
+    }
+
+    // the output is thrown away, only the running state is needed
+    uint8_t out[64 * 1024];
+    int res = Z_OK;
+    bool valid = true;
+    while (valid && res != Z_STREAM_END && !data.empty()) {
+        const auto length = read(data);
+        const auto type = read(data);
+        auto payload = subspan(data, 0, length);
+        data = subspan(data, length + sizeof(uint32_t));
+        if (type == 0x49454E44) { // IEND
+            break;
+        }
+        if (type != 0x49444154) { // IDAT
+            continue;
+        }
+        stream.next_in = payload.data();
+        stream.avail_in = payload.size();
+        fuzz_count(payload.size());
+        while (stream.avail_in && res != Z_STREAM_END) {
+            stream.next_out = out;
+            stream.avail_out = sizeof(out);
+            // the zlib header and adler32 are verified by inflate itself
+            res = inflate(&stream, Z_NO_FLUSH);
+            fuzz_count(0);
+            if (res != Z_OK && res != Z_STREAM_END) {
+                valid = false;
+                break;
+            }
+            if (!rows.feed(out, sizeof(out) - stream.avail_out)) {
+                valid = false;
+                break;
+            }
+        }
+    }
+    // flush whatever is still pending inside of inflate
+    while (valid && res == Z_OK) {
+        stream.next_out = out;
+        stream.avail_out = sizeof(out);
+        res = inflate(&stream, Z_SYNC_FLUSH);
+        fuzz_count(0);
+        const auto n = sizeof(out) - stream.avail_out;
+        if ((res != Z_OK && res != Z_STREAM_END) || !rows.feed(out, n)) {
+            valid = false;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+    }
+    const auto total_out = stream.total_out;
+    inflateEnd(&stream);
+
+    return valid && res == Z_STREAM_END && total_out == expected;
+}
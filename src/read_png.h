@@ -3,8 +3,49 @@
 
 #include <span>
 #include <cstdint>
+#include "image_info.h"
+#include "parser.h"
 
 constexpr uint8_t FIRST_BYTE_PNG = 0x89;
-std::span<const uint8_t> read_png(std::span<const uint8_t> data);
+std::span<const uint8_t> read_png(std::span<const uint8_t> data, image_info* info = nullptr);
+
+// read_png as a state machine, see parser.h
+class png_parser {
+public:
+    // false if data can't be the start of one, looks at the signature only
+    static bool starts(std::span<const uint8_t> data);
+    PARSE feed(std::span<const uint8_t> data);
+    uint64_t size() const {
+        return consumed;
+    }
+    image_info info;
+
+private:
+    enum EXPECT : uint8_t {
+        MAGIC,
+        CHUNK,      // length and type
+        DATA,
+        CRC
+    };
+
+    PARSE chunk();
+    PARSE end();
+
+    EXPECT expect = MAGIC;
+    uint32_t type = 0;
+    uint32_t length = 0;
+    uint32_t left = 0;
+    uint32_t crc = 0;       // of type and data so far
+    bool found_ihdr = false;
+    bool found_idat = false;
+    bool animated = false;
+    gather<8> head{ {}, 0, 8 };
+    gather<13> ihdr;        // as much of IHDR as there is
+    uint64_t consumed = 0;
+};
+
+// inflates the IDAT stream of a png returned by read_png without keeping the output
+// checks the zlib header, the adler32 and that the size matches IHDR
+bool check_png_data(std::span<const uint8_t> png);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,244 @@
+#include "read_psd.h"
+#include "utils.h"
+
+namespace {
+    template<typename T>
+    T _read(std::span<const uint8_t>& data) {
+        return ::read<T, std::endian::big>(data);
+    }
+
+    constexpr auto SIGNATURE           = convert<uint32_t, std::endian::native, std::endian::big>(0x38425053);
+    constexpr auto SIGNATURE_RESOURCE  = convert<uint32_t, std::endian::native, std::endian::big>(0x3842494D);
+    // of the resources written by photodeluxe
+    constexpr auto SIGNATURE_MESA      = convert<uint32_t, std::endian::native, std::endian::big>(0x4D655341);
+
+    constexpr uint16_t MAX_CHANNELS = 56;
+    constexpr uint32_t MAX_SIZE_PSD = 30000;
+    constexpr uint32_t MAX_SIZE_PSB = 300000;
+
+    enum MODE : uint16_t {
+        BITMAP = 0,
+        INDEXED = 2,
+        DUOTONE = 8
+    };
+
+    bool valid_mode(uint16_t mode) {
+        switch (mode) {
+            case 0: // bitmap
+            case 1: // grayscale
+            case 2: // indexed
+            case 3: // rgb
+            case 4: // cmyk
+            case 7: // multichannel
+            case 8: // duotone
+            case 9: // lab
+                return true;
+        }
+        return false;
+    }
+
+    enum COMPRESSION : uint16_t {
+        RAW = 0,
+        RLE = 1
+        // 2 and 3 are zip, their end is only known by inflating them
+    };
+}
+
+// based on https://www.adobe.com/devnet-apps/photoshop/fileformatashtml/
+
+bool psd_parser::starts(std::span<const uint8_t> data) {
+    return starts_with(data, SIGNATURE);
+}
+
+PARSE psd_parser::header() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    if (read<uint32_t>(data) != SIGNATURE) {
+        return PARSE_FAILED;
+    }
+    const auto version = _read<uint16_t>(data);
+    if (version != 1 && version != 2) {
+        return PARSE_FAILED;
+    }
+    large = version == 2;
+    // reserved
+    if (_read<uint32_t>(data) != 0 || _read<uint16_t>(data) != 0) {
+        return PARSE_FAILED;
+    }
+    channels = _read<uint16_t>(data);
+    const auto height = _read<uint32_t>(data);
+    const auto width = _read<uint32_t>(data);
+    const auto depth = _read<uint16_t>(data);
+    mode = _read<uint16_t>(data);
+    const auto max_size = large ? MAX_SIZE_PSB : MAX_SIZE_PSD;
+    if (channels == 0 || channels > MAX_CHANNELS) {
+        return PARSE_FAILED;
+    }
+    if (width == 0 || height == 0 || width > max_size || height > max_size) {
+        return PARSE_FAILED;
+    }
+    if (depth != 1 && depth != 8 && depth != 16 && depth != 32) {
+        return PARSE_FAILED;
+    }
+    if (!valid_mode(mode) || (mode == BITMAP) != (depth == 1)) {
+        return PARSE_FAILED;
+    }
+    row = (uint64_t(width) * depth + 7) / 8;
+    rows = uint64_t(height) * channels;
+
+    info.width = width;
+    info.height = height;
+    info.variant = large ? "psb" : "";
+    head.start(4);
+    expect = LENGTH;
+    return PARSE_MORE;
+}
+
+PARSE psd_parser::length() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    left = head.have == 8 ? _read<uint64_t>(data) : _read<uint32_t>(data);
+    switch (section) {
+        case COLOR_MODE_DATA:
+            // the palette of indexed images, anything for duotone
+            if (mode == INDEXED ? left != 768 : mode != DUOTONE && left != 0) {
+                return PARSE_FAILED;
+            }
+            break;
+        case IMAGE_RESOURCES:
+            if (left != 0) {
+                // signature, id, an empty name and the length of the data
+                if (left < 12) {
+                    return PARSE_FAILED;
+                }
+                head.start(4);
+                expect = RESOURCES;
+                return PARSE_MORE;
+            }
+            break;
+        default:
+            break;
+    }
+    expect = SKIP;
+    if (left == 0) {
+        return section_end();
+    }
+    return PARSE_MORE;
+}
+
+PARSE psd_parser::section_end() {
+    section = SECTION(section + 1);
+    if (section == IMAGE_DATA) {
+        head.start(2);
+        expect = COMPRESSION;
+        return PARSE_MORE;
+    }
+    // only the length of the layer section grows in a psb
+    head.start(section == LAYERS && large ? 8 : 4);
+    expect = LENGTH;
+    return PARSE_MORE;
+}
+
+PARSE psd_parser::compression() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    switch (_read<uint16_t>(data)) {
+        case RAW:
+            left = rows * row;
+            expect = DATA;
+            return PARSE_MORE;
+        case RLE:
+            // the byte count of every row of every channel, then the rows
+            left = rows;
+            head.start(large ? 4 : 2);
+            expect = COUNTS;
+            return PARSE_MORE;
+    }
+    return PARSE_FAILED;
+}
+
+PARSE psd_parser::count() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    const uint64_t n = head.have == 4 ? _read<uint32_t>(data) : _read<uint16_t>(data);
+    // packbits grows a row by a byte per 128 at most
+    if (n > row + row / 128 + 2) {
+        return PARSE_FAILED;
+    }
+    compressed += n;
+    if (--left != 0) {
+        head.start(head.want);
+        return PARSE_MORE;
+    }
+    left = compressed;
+    expect = DATA;
+    if (left == 0) {
+        return PARSE_DONE;
+    }
+    return PARSE_MORE;
+}
+
+PARSE psd_parser::feed(std::span<const uint8_t> data) {
+    const auto available = data.size();
+    auto result = PARSE_MORE;
+    while (result == PARSE_MORE && !data.empty()) {
+        switch (expect) {
+            case HEADER:
+                if (head.take(data)) {
+                    result = header();
+                }
+                break;
+            case LENGTH:
+                if (head.take(data)) {
+                    result = length();
+                }
+                break;
+            case RESOURCES:
+                if (head.take(data)) {
+                    auto signature = std::span<const uint8_t>(head.bytes, head.have);
+                    const auto s = read<uint32_t>(signature);
+                    if (s != SIGNATURE_RESOURCE && s != SIGNATURE_MESA) {
+                        result = PARSE_FAILED;
+                        break;
+                    }
+                    left -= head.have;
+                    expect = SKIP;
+                }
+                break;
+            case SKIP:
+                left = skip_bytes(data, left);
+                if (left == 0) {
+                    result = section_end();
+                }
+                break;
+            case COMPRESSION:
+                if (head.take(data)) {
+                    result = compression();
+                }
+                break;
+            case COUNTS:
+                if (head.take(data)) {
+                    result = count();
+                }
+                break;
+            case DATA:
+                left = skip_bytes(data, left);
+                if (left == 0) {
+                    result = PARSE_DONE;
+                }
+                break;
+        }
+    }
+    consumed += available - data.size();
+    return result;
+}
+
+std::span<const uint8_t> read_psd(std::span<const uint8_t> data, image_info* info) {
+    if (!psd_parser::starts(data)) [[likely]] {
+        return {};
+    }
+    psd_parser parser;
+    if (parser.feed(data) != PARSE_DONE) {
+        return {};
+    }
+    if (info) {
+        *info = parser.info;
+    }
+    return data.first(parser.size());
+}
@@ -0,0 +1,61 @@
+#ifndef H_READ_PSD
+#define H_READ_PSD
+
+#include <span>
+#include <cstdint>
+#include "image_info.h"
+#include "parser.h"
+
+constexpr uint8_t FIRST_BYTE_PSD = 0x38;
+// photoshop documents, PSD and the large document format PSB
+std::span<const uint8_t> read_psd(std::span<const uint8_t> data, image_info* info = nullptr);
+
+// read_psd as a state machine, see parser.h
+class psd_parser {
+public:
+    // false if data can't be the start of one, looks at the signature only
+    static bool starts(std::span<const uint8_t> data);
+    PARSE feed(std::span<const uint8_t> data);
+    uint64_t size() const {
+        return consumed;
+    }
+    image_info info;
+
+private:
+    enum EXPECT : uint8_t {
+        HEADER,
+        LENGTH,         // of the next section
+        RESOURCES,      // the signature of the first image resource
+        SKIP,           // the rest of the section
+        COMPRESSION,    // of the image data
+        COUNTS,         // bytes of the next RLE compressed row
+        DATA
+    };
+    // the sections after the header
+    enum SECTION : uint8_t {
+        COLOR_MODE_DATA,
+        IMAGE_RESOURCES,
+        LAYERS,
+        IMAGE_DATA
+    };
+
+    PARSE header();
+    PARSE length();
+    PARSE section_end();
+    PARSE compression();
+    PARSE count();
+
+    EXPECT expect = HEADER;
+    SECTION section = COLOR_MODE_DATA;
+    bool large = false;         // PSB
+    uint16_t channels = 0;
+    uint16_t mode = 0;
+    uint64_t row = 0;           // bytes of an uncompressed row of one channel
+    uint64_t rows = 0;          // of all channels
+    uint64_t left = 0;
+    uint64_t compressed = 0;    // RLE bytes after the counts
+    gather<26> head{ {}, 0, 26 };
+    uint64_t consumed = 0;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <cctype>
 #include <cstdio>
 #include <deque>
+#include <unordered_set>
 
 namespace {
     // https://www.fileformat.info/format/tiff/egff.htm
@@ -28,11 +29,42 @@ namespace {
         IFD = 1 << 13
     };
 
+    // SubIFDs in SubIFDs in ..
+    constexpr int MAX_DEPTH = 4;
+
+    const char* compression_name(uint16_t compression) {
+        switch (compression) {
+            case 1:     return "uncompressed";
+            case 2:     return "ccitt";
+            case 3:     return "t4";
+            case 4:     return "t6";
+            case 5:     return "lzw";
+            case 6:     return "ojpeg";
+            case 7:     return "jpeg";
+            case 8:     return "deflate";
+            case 32773: return "packbits";
+            default:    return "";
+        }
+    }
+
+    // SHORT and LONG values that fit into the offset field
+    template<std::endian endian> uint32_t read_value(std::span<const uint8_t> value, uint16_t data_type) {
+        return data_type == 3 ? peek<uint16_t, endian>(value) : peek<uint32_t, endian>(value);
+    }
+
+    // data is at position of start, need is how much of start was looked at
+    // seen are the directories read so far, a chain pointing back to one of them never ends
+    // walked is what the directories and offset arrays took, in a valid file they don't overlap and stay below need
+    // so overlapping directories can't be walked over and over
     template<std::endian endian>
-    bool read_ifd(std::span<const uint8_t> start, std::span<const uint8_t> data, uint32_t& length, bool& has_image_data, bool private_ifd = false) {
+    bool read_ifd(std::span<const uint8_t> start, std::span<const uint8_t> data, uint64_t position, uint64_t& length, uint64_t& need, uint64_t& walked, bool& has_image_data, image_info& info, std::unordered_set<uint32_t>& seen, bool private_ifd = false, int depth = 0) {
+        if (depth > MAX_DEPTH) {
+            return false;
+        }
         // read directory
         bool found_end = false;
 
+        need = std::max<uint64_t>(need, position + sizeof(uint32_t));
         while (!data.empty()) {
             auto offset = peek<uint32_t, endian>(data);
             if (offset == 0) {
@@ -44,19 +76,32 @@ namespace {
                 // must begin on a word boundary
                 return false;
             }
+            if (!seen.insert(offset).second) {
+                return false;
+            }
 
             data = subspan(start, offset);
             // read tags
+            need = std::max<uint64_t>(need, offset + sizeof(uint16_t));
             auto entries = read<uint16_t, endian>(data);
 
             if (entries == 0) {
                 return false;
             }
+            position = offset + sizeof(uint16_t) + entries * sizeof(uint32_t) * 3;
+            need = std::max<uint64_t>(need, position + sizeof(uint32_t));
 
-            length = std::max(length, uint32_t(offset + entries * sizeof(uint32_t) * 3 + sizeof(uint32_t)));
+            length = std::max(length, position + sizeof(uint32_t));
+            walked += position + sizeof(uint32_t) - offset;
+            if (walked > need) {
+                return false;
+            }
 
-            std::deque<uint32_t> ImageDataOffsets;
-            std::deque<uint32_t> ImageDataByteCounts;
+            std::deque<uint64_t> ImageDataOffsets;
+            std::deque<uint64_t> ImageDataByteCounts;
+            uint32_t width = 0;
+            uint32_t height = 0;
+            uint16_t compression = 1;
 
             uint16_t last_tag_id = 0;
             for (auto i = 0; i < entries; ++i) {
@@ -191,6 +236,10 @@ namespace {
                 }
 
                 // check types
+                if (data_type == 0 || data_type > 13) {
+                    // unknown, its length can't be known either
+                    return false;
+                }
                 if (required_type && !(required_type & (1 << data_type))) {
                     // we check here for the corect type .. but
                     /*
@@ -207,42 +256,42 @@ namespace {
                     return false;
                 }
 
-                uint32_t data_length = 0;
+                uint64_t data_length = 0;
                 switch (data_type) {
                     case 1: // BYTE
                     case 2: // ASCII
-                        data_length = data_count * sizeof(uint8_t);
+                        data_length = uint64_t(data_count) * sizeof(uint8_t);
                         break;
                     case 3: // SHORT
-                        data_length = data_count * sizeof(uint16_t);
+                        data_length = uint64_t(data_count) * sizeof(uint16_t);
                         break;
                     case 4:  // LONG
                     case 13: // IFD
-                        data_length = data_count * sizeof(uint32_t);
+                        data_length = uint64_t(data_count) * sizeof(uint32_t);
                         break;
                     case 5: // RATIONAL
-                        data_length = data_count * sizeof(uint64_t);
+                        data_length = uint64_t(data_count) * sizeof(uint64_t);
                         break;
                     case 6: // SBYTE
-                        data_length = data_count * sizeof(int8_t);
+                        data_length = uint64_t(data_count) * sizeof(int8_t);
                         break;
                     case 7: // UNDEFINE
-                        data_length = data_count;
+                        data_length = uint64_t(data_count);
                         break;
                     case 8: // SSHORT
-                        data_length = data_count * sizeof(int16_t);
+                        data_length = uint64_t(data_count) * sizeof(int16_t);
                         break;
                     case 9: // SLONG
-                        data_length = data_count * sizeof(int32_t);
+                        data_length = uint64_t(data_count) * sizeof(int32_t);
                         break;
                     case 10: // SRATIONAL
-                        data_length = data_count * sizeof(int64_t);
+                        data_length = uint64_t(data_count) * sizeof(int64_t);
                         break;
                     case 11: // FLOAT
-                        data_length = data_count * sizeof(float);
+                        data_length = uint64_t(data_count) * sizeof(float);
                         break;
                     case 12: // DOUBLE
-                        data_length = data_count * sizeof(double);
+                        data_length = uint64_t(data_count) * sizeof(double);
                         break;
                 }
 
@@ -254,19 +303,44 @@ namespace {
                     */
 
                     length = std::max(length, data_offset + data_length);
+                    if (length > UINT32_MAX) {
+                        // the offsets are 32 bit, nothing can end past them
+                        return false;
+                    }
                 }
 
-                if (ifd && !read_ifd<endian>(start, data_offset_before_offset, length, has_image_data, private_ifd || ifd == 2)) {
+                const auto value = offset + sizeof(uint16_t) + i * sizeof(uint32_t) * 3 + 2 * sizeof(uint32_t);
+                if (ifd && !read_ifd<endian>(start, data_offset_before_offset, value, length, need, walked, has_image_data, info, seen, private_ifd || ifd == 2, depth + 1)) {
                     return false;
                 }
 
                 // image data
                 if (!private_ifd) {
                     switch (tag_id) {
+                        case 0x0100: // ImageWidth
+                            width = read_value<endian>(data_offset_before_offset, data_type);
+                            break;
+                        case 0x0101: // ImageLength
+                            height = read_value<endian>(data_offset_before_offset, data_type);
+                            break;
+                        case 0x0103: // Compression
+                            compression = read_value<endian>(data_offset_before_offset, data_type);
+                            break;
                         case 0x0111: // StripOffsets
                         case 0x0144: // TileOffsets
                         {
                             auto s = data_length > sizeof(uint32_t) ? subspan(start, data_offset) : data_offset_before_offset;
+                            if (data_length > sizeof(uint32_t)) {
+                                need = std::max<uint64_t>(need, data_offset + data_length);
+                                if (need > start.size()) {
+                                    // read again once the rest is there
+                                    return false;
+                                }
+                                walked += data_length;
+                                if (walked > need) {
+                                    return false;
+                                }
+                            }
                             for (uint32_t j = 0; j < data_count; ++j) {
                                 uint32_t o = data_type == 3 ? read<uint16_t, endian>(s) : read<uint32_t, endian>(s);
                                 ImageDataOffsets.push_back(o);
@@ -277,6 +351,17 @@ namespace {
                         case 0x0145: // TileByteCounts
                         {
                             auto s = data_length > sizeof(uint32_t) ? subspan(start, data_offset) : data_offset_before_offset;
+                            if (data_length > sizeof(uint32_t)) {
+                                need = std::max<uint64_t>(need, data_offset + data_length);
+                                if (need > start.size()) {
+                                    // read again once the rest is there
+                                    return false;
+                                }
+                                walked += data_length;
+                                if (walked > need) {
+                                    return false;
+                                }
+                            }
                             for (uint32_t j = 0; j < data_count; ++j) {
                                 uint32_t o = data_type == 3 ? read<uint16_t, endian>(s) : read<uint32_t, endian>(s);
                                 ImageDataByteCounts.push_back(o);
@@ -295,45 +380,96 @@ namespace {
                 for (size_t i = 0; i < ImageDataOffsets.size(); ++i) {
                     length = std::max(length, ImageDataOffsets[i] + ImageDataByteCounts[i]);
                 }
+                if (length > UINT32_MAX) {
+                    return false;
+                }
                 has_image_data = true;
+                // the largest subfile is the image, the rest are thumbnails or masks
+                if (uint64_t(width) * height > uint64_t(info.width) * info.height) {
+                    info.width = width;
+                    info.height = height;
+                    info.variant = compression_name(compression);
+                }
             }
         }
 
         return found_end;
     }
 
+    // MORE while the directories or the image reach past the end of data
     template<std::endian endian>
-    std::span<const uint8_t> read_tif(std::span<const uint8_t> data) {
+    PARSE read_tif(std::span<const uint8_t> data, uint64_t& length, uint64_t& need, image_info& info) {
         const auto start = data;
 
         skip<decltype(SIGNATURE_BIG)>(data);
 
-        uint32_t length = 0;
+        length = 0;
+        need = 0;
         bool has_image_data = false;
-        if (!read_ifd<endian>(start, data, length, has_image_data)) {
-            return {};
+        image_info found;
+        uint64_t walked = 0;
+        std::unordered_set<uint32_t> seen;
+        const bool valid = read_ifd<endian>(start, data, sizeof(SIGNATURE_BIG), length, need, walked, has_image_data, found, seen);
+        // the size is checked too
+        need = std::max<uint64_t>(need, length);
+        if (need > start.size()) {
+            // zeros were read in place of the missing bytes
+            return PARSE_MORE;
         }
-
-        if (!has_image_data) {
-            return {};
+        if (!valid || !has_image_data) {
+            return PARSE_FAILED;
         }
+        info = found;
+        return PARSE_DONE;
+    }
+}
 
-        // found something
-        data = subspan(start, 0, length);
-        if (data.size() != length) {
-            // wrong size
-            return {};
-        }
-        return data;
+bool tif_parser::starts(std::span<const uint8_t> data) {
+    return starts_with(data, SIGNATURE_BIG) || starts_with(data, SIGNATURE_LITTLE);
+}
+
+PARSE tif_parser::parse(std::span<const uint8_t> data) {
+    PARSE result = PARSE_FAILED;
+    if (data.size() < sizeof(SIGNATURE_BIG)) {
+        result = PARSE_MORE;
+        need = sizeof(SIGNATURE_BIG);
+    } else if (peek<decltype(SIGNATURE_BIG)>(data) == SIGNATURE_BIG) {
+        result = read_tif<std::endian::big>(data, length, need, info);
+    } else if (peek<decltype(SIGNATURE_LITTLE)>(data) == SIGNATURE_LITTLE) {
+        result = read_tif<std::endian::little>(data, length, need, info);
+    }
+    if (result == PARSE_MORE && need > limit) {
+        return PARSE_FAILED;
     }
+    return result;
 }
 
-std::span<const uint8_t> read_tif(std::span<const uint8_t> data) {
-    if (peek<decltype(SIGNATURE_BIG)>(data) == SIGNATURE_BIG) [[unlikely]] {
-        return read_tif<std::endian::big>(data);
-    } else if (peek<decltype(SIGNATURE_LITTLE)>(data) == SIGNATURE_LITTLE) [[unlikely]] {
-        return read_tif<std::endian::little>(data);
+PARSE tif_parser::feed(std::span<const uint8_t> data) {
+    if (kept.empty()) {
+        // parsed in place as long as it fits into the first buffer
+        const auto result = parse(data);
+        if (result == PARSE_MORE) {
+            kept.assign(data.begin(), data.end());
+        }
+        return result;
+    }
+    kept.insert(kept.end(), data.begin(), data.end());
+    if (kept.size() < need) {
+        return PARSE_MORE;
     }
-    return {};
+    return parse(kept);
 }
 
+std::span<const uint8_t> read_tif(std::span<const uint8_t> data, image_info* info) {
+    if (!tif_parser::starts(data)) [[likely]] {
+        return {};
+    }
+    tif_parser parser;
+    if (parser.feed(data) != PARSE_DONE) {
+        return {};
+    }
+    if (info) {
+        *info = parser.info;
+    }
+    return data.first(parser.size());
+}
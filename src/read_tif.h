@@ -3,9 +3,40 @@
 
 #include <span>
 #include <cstdint>
+#include <vector>
+#include "image_info.h"
+#include "parser.h"
 
 constexpr uint8_t FIRST_BYTE_TIF_LITTLE = 0x49;
 constexpr uint8_t FIRST_BYTE_TIF_BIG    = 0x4D;
-std::span<const uint8_t> read_tif(std::span<const uint8_t> data);
+std::span<const uint8_t> read_tif(std::span<const uint8_t> data, image_info* info = nullptr);
+
+// read_tif fed buffer by buffer, see parser.h
+// the directories may point anywhere, so the bytes are kept until everything they point to is there
+class tif_parser {
+public:
+    // images longer than limit aren't waited for
+    explicit tif_parser(uint64_t limit = UINT64_MAX) : limit(limit) {}
+    // false if data can't be the start of one, looks at the signature only
+    static bool starts(std::span<const uint8_t> data);
+    PARSE feed(std::span<const uint8_t> data);
+    // looks at data in place and keeps nothing, MORE if it needs() more of it
+    // for a caller that can hand over a longer front of the same candidate next time
+    PARSE parse(std::span<const uint8_t> data);
+    uint64_t needs() const {
+        return need;
+    }
+    uint64_t size() const {
+        return length;
+    }
+    image_info info;
+
+private:
+
+    uint64_t limit;
+    std::vector<uint8_t> kept;  // everything fed, once the first buffer wasn't enough
+    uint64_t need = 0;          // bytes the next parse needs at least
+    uint64_t length = 0;
+};
 
 #endif
\ No newline at end of file
@@ -8,45 +8,350 @@ namespace {
         return ::read<T, std::endian::little>(data);
     }
 
+    uint32_t _read24(std::span<const uint8_t>& data) {
+        uint32_t value = _read<uint16_t>(data);
+        return value | (uint32_t(_read<uint8_t>(data)) << 16);
+    }
+
     constexpr auto SIGNATURE_RIFF = convert<uint32_t, std::endian::native, std::endian::big>(0x52494646);
     constexpr auto SIGNATURE_WEBP = convert<uint32_t, std::endian::native, std::endian::big>(0x57454250);
+
+    // FourCC in big-endian
+    enum CHUNK : uint32_t {
+        VP8  = 0x56503820,
+        VP8L = 0x5650384C,
+        VP8X = 0x56503858,
+        ALPH = 0x414C5048,
+        ANIM = 0x414E494D,
+        ANMF = 0x414E4D46,
+        ICCP = 0x49434350,
+        EXIF = 0x45584946,
+        XMP  = 0x584D5020
+    };
+
+    // VP8X flags
+    constexpr uint8_t FLAG_ANIMATION = 1 << 1;
+    constexpr uint8_t FLAG_XMP       = 1 << 2;
+    constexpr uint8_t FLAG_EXIF      = 1 << 3;
+    constexpr uint8_t FLAG_ALPHA     = 1 << 4;
+    constexpr uint8_t FLAG_ICC       = 1 << 5;
+
+    // checks the bitstream header, returns the dimensions
+    // data is the start of the payload, size the size of all of it
+    // https://datatracker.ietf.org/doc/html/rfc6386#section-9.1
+    // https://developers.google.com/speed/webp/docs/webp_lossless_bitstream_specification
+    bool read_bitstream(uint32_t type, std::span<const uint8_t> data, uint32_t size, uint32_t& width, uint32_t& height) {
+        if (type == VP8) {
+            if (size < 10) {
+                return false;
+            }
+            const auto tag = _read24(data);
+            const bool key_frame = !(tag & 1);
+            const auto version = (tag >> 1) & 7;
+            const bool show_frame = (tag >> 4) & 1;
+            const auto first_partition_size = tag >> 5;
+            if (!key_frame || version > 3 || !show_frame) {
+                return false;
+            }
+            if (first_partition_size > size - 10) {
+                return false;
+            }
+            if (_read24(data) != 0x2A019D) {
+                // start code
+                return false;
+            }
+            width = _read<uint16_t>(data) & 0x3FFF;
+            height = _read<uint16_t>(data) & 0x3FFF;
+        } else if (type == VP8L) {
+            if (size < 5) {
+                return false;
+            }
+            if (_read<uint8_t>(data) != 0x2F) {
+                // signature
+                return false;
+            }
+            const auto bits = _read<uint32_t>(data);
+            if (bits >> 29 != 0) {
+                // version
+                return false;
+            }
+            width = (bits & 0x3FFF) + 1;
+            height = ((bits >> 14) & 0x3FFF) + 1;
+        } else {
+            return false;
+        }
+        return width && height;
+    }
 }
 
-std::span<const uint8_t> read_webp(std::span<const uint8_t> data) {
-    // based on https://developers.google.com/speed/webp/docs/riff_container
+// based on https://developers.google.com/speed/webp/docs/riff_container
 
-    if (peek<decltype(SIGNATURE_RIFF)>(data) != SIGNATURE_RIFF) [[likely]] {
-        return {};
+bool webp_parser::starts(std::span<const uint8_t> data) {
+    return starts_with(data, SIGNATURE_RIFF) && starts_with(subspan(data, 0x08), SIGNATURE_WEBP);
+}
+
+PARSE webp_parser::header() {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    if (read<decltype(SIGNATURE_RIFF)>(data) != SIGNATURE_RIFF) {
+        return PARSE_FAILED;
     }
-    if (peek<decltype(SIGNATURE_WEBP)>(data, 0x08) != SIGNATURE_WEBP) [[likely]] {
-        return {};
+    const auto size = _read<uint32_t>(data);
+    if (read<decltype(SIGNATURE_WEBP)>(data) != SIGNATURE_WEBP) {
+        return PARSE_FAILED;
+    }
+    end = 2 * sizeof(uint32_t) + uint64_t(size) + (size & 1);
+    return boundary(head.have);
+}
+
+// after a chunk
+PARSE webp_parser::boundary(uint64_t position) {
+    if (in_frame || alpha) {
+        // the image isn't complete yet
+        return next_chunk(position);
     }
+    if (position < end) {
+        return next_chunk(position);
+    }
+    if ((flags & FLAG_ANIMATION) ? frames == 0 : !found_image) {
+        return PARSE_FAILED;
+    }
+    info.width = canvas_width;
+    info.height = canvas_height;
+    info.variant = (flags & FLAG_ANIMATION) ? "animated" : lossless ? "lossless" : "lossy";
+    info.parts = frames;
+    return PARSE_DONE;
+}
 
-    auto start = data.data();
+// the chunk header has to fit into the RIFF chunk or the frame
+PARSE webp_parser::next_chunk(uint64_t position) {
+    const auto limit = in_frame ? frame_end : end;
+    if (position > limit || limit - position < 2 * sizeof(uint32_t)) {
+        return PARSE_FAILED;
+    }
+    head.start(2 * sizeof(uint32_t));
+    expect = CHUNK;
+    return PARSE_MORE;
+}
 
-    skip<decltype(SIGNATURE_RIFF)>(data);
-    auto size = read<uint32_t, std::endian::little>(data);
-    if (size % 2 != 0) {
-        size += 1;
+PARSE webp_parser::skip_to(uint64_t position, uint64_t to) {
+    left = to - position;
+    if (left == 0) {
+        return boundary(position);
     }
-    data = subspan(data, 0, size);
-    if (data.size() != size) {
-        return {};
+    expect = SKIP;
+    return PARSE_MORE;
+}
+
+// gathers the first n bytes of the payload for payload()
+PARSE webp_parser::check(uint64_t position, size_t n) {
+    head.start(n);
+    if (n == 0) {
+        return payload(position);
     }
+    expect = PAYLOAD;
+    return PARSE_MORE;
+}
 
-    auto end = data.data() + size;
+PARSE webp_parser::chunk(uint64_t position) {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    type = read<uint32_t, std::endian::big>(data);
+    length = _read<uint32_t>(data);
+    for (auto i = 0; i < 4; ++i) {
+        const auto ch = (type >> (i * 8)) & 0xFF;
+        if (!std::isalnum(ch) && ch != ' ') {
+            return PARSE_FAILED;
+        }
+    }
+    const auto limit = in_frame ? frame_end : end;
+    const uint64_t padded = uint64_t(length) + (length & 1);
+    if (padded > limit - position) {
+        return PARSE_FAILED;
+    }
+    chunk_end = position + padded;
 
-    skip<decltype(SIGNATURE_WEBP)>(data);
-    switch (read<uint32_t, std::endian::big>(data))
-    {
-        case 0x56503820: // VP8
-        case 0x5650384C: // VP8L
-        case 0x56503858: // VP8X
+    if (in_frame || alpha) {
+        return image_chunk(position);
+    }
+    if (!extended && !found_image) {
+        if (type == VP8 || type == VP8L) {
+            // simple format, nothing but the bitstream
+            if (chunk_end != end) {
+                return PARSE_FAILED;
+            }
+            return check(position, std::min<uint32_t>(length, 10));
+        }
+        if (type != VP8X || length < 10) {
+            return PARSE_FAILED;
+        }
+        return check(position, 10);
+    }
+
+    // extended format
+    switch (type) {
+        case ICCP:
+            if (!(flags & FLAG_ICC) || found_image || found_anim) {
+                return PARSE_FAILED;
+            }
+            break;
+        case ANIM:
+            if (!(flags & FLAG_ANIMATION) || found_anim || length != 6) {
+                return PARSE_FAILED;
+            }
+            found_anim = true;
+            break;
+        case ANMF:
+            if (!found_anim || length < 16) {
+                return PARSE_FAILED;
+            }
+            return check(position, 16);
+        case ALPH:
+        case VP8:
+        case VP8L:
+            if ((flags & FLAG_ANIMATION) || found_image) {
+                return PARSE_FAILED;
+            }
+            if (type == ALPH && !(flags & FLAG_ALPHA)) {
+                return PARSE_FAILED;
+            }
+            image_width = canvas_width;
+            image_height = canvas_height;
+            return image_chunk(position);
+        case EXIF:
+            if (!(flags & FLAG_EXIF)) {
+                return PARSE_FAILED;
+            }
+            break;
+        case XMP:
+            if (!(flags & FLAG_XMP)) {
+                return PARSE_FAILED;
+            }
             break;
+        case VP8X:
+            return PARSE_FAILED;
         default:
-            return {};
+            // unknown chunks are ignored by readers
+            break;
     }
+    return skip_to(position, chunk_end);
+}
 
-    return {start, end};
+// optional ALPH followed by VP8, or a single VP8L
+PARSE webp_parser::image_chunk(uint64_t position) {
+    if (type == ALPH && !alpha) {
+        if (length == 0) {
+            return PARSE_FAILED;
+        }
+        alpha = true;
+        return skip_to(position, chunk_end);
+    }
+    if (type == VP8 || (type == VP8L && !alpha)) {
+        return check(position, std::min<uint32_t>(length, 10));
+    }
+    return PARSE_FAILED;
 }
 
+PARSE webp_parser::payload(uint64_t position) {
+    auto data = std::span<const uint8_t>(head.bytes, head.have);
+    if (type == VP8X) {
+        flags = _read<uint8_t>(data);
+        if (flags & 0xC1 || _read24(data) != 0) {
+            // reserved
+            return PARSE_FAILED;
+        }
+        canvas_width = _read24(data) + 1;
+        canvas_height = _read24(data) + 1;
+        if (uint64_t(canvas_width) * canvas_height > 0xFFFFFFFF) {
+            return PARSE_FAILED;
+        }
+        extended = true;
+        return skip_to(position, chunk_end);
+    }
+    if (type == ANMF) {
+        const uint64_t x = 2 * _read24(data);
+        const uint64_t y = 2 * _read24(data);
+        image_width = _read24(data) + 1;
+        image_height = _read24(data) + 1;
+        skip<uint8_t>(data, 3); // duration
+        if (_read<uint8_t>(data) & 0xFC) {
+            // reserved
+            return PARSE_FAILED;
+        }
+        if (x + image_width > canvas_width || y + image_height > canvas_height) {
+            return PARSE_FAILED;
+        }
+        // unknown chunks after the image data are allowed
+        in_frame = true;
+        frame_end = chunk_end - (length & 1);
+        frame_chunk_end = chunk_end;
+        return next_chunk(position);
+    }
+
+    uint32_t width = 0, height = 0;
+    if (!read_bitstream(type, data, length, width, height)) {
+        return PARSE_FAILED;
+    }
+    if (!extended) {
+        canvas_width = width;
+        canvas_height = height;
+    } else if (width != image_width || height != image_height) {
+        return PARSE_FAILED;
+    }
+    alpha = false;
+    if (in_frame) {
+        in_frame = false;
+        ++frames;
+        return skip_to(position, frame_chunk_end);
+    }
+    found_image = true;
+    lossless = type == VP8L;
+    return skip_to(position, chunk_end);
+}
+
+PARSE webp_parser::feed(std::span<const uint8_t> data) {
+    const auto available = data.size();
+    const auto position = [&] {
+        return consumed + (available - data.size());
+    };
+    auto result = PARSE_MORE;
+    while (result == PARSE_MORE && !data.empty()) {
+        switch (expect) {
+            case HEADER:
+                if (head.take(data)) {
+                    result = header();
+                }
+                break;
+            case CHUNK:
+                if (head.take(data)) {
+                    result = chunk(position());
+                }
+                break;
+            case PAYLOAD:
+                if (head.take(data)) {
+                    result = payload(position());
+                }
+                break;
+            case SKIP:
+                left = skip_bytes(data, left);
+                if (left == 0) {
+                    result = boundary(position());
+                }
+                break;
+        }
+    }
+    consumed += available - data.size();
+    return result;
+}
+
+std::span<const uint8_t> read_webp(std::span<const uint8_t> data, image_info* info) {
+    if (!webp_parser::starts(data)) [[likely]] {
+        return {};
+    }
+    webp_parser parser;
+    if (parser.feed(data) != PARSE_DONE) {
+        return {};
+    }
+    if (info) {
+        *info = parser.info;
+    }
+    return data.first(parser.size());
+}
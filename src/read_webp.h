@@ -3,8 +3,64 @@
 
 #include <span>
 #include <cstdint>
+#include "image_info.h"
+#include "parser.h"
 
 constexpr uint8_t FIRST_BYTE_WEBP = 0x52;
-std::span<const uint8_t> read_webp(std::span<const uint8_t> data);
+std::span<const uint8_t> read_webp(std::span<const uint8_t> data, image_info* info = nullptr);
+
+// read_webp as a state machine, see parser.h
+class webp_parser {
+public:
+    // false if data can't be the start of one, looks at the signature only
+    static bool starts(std::span<const uint8_t> data);
+    PARSE feed(std::span<const uint8_t> data);
+    uint64_t size() const {
+        return consumed;
+    }
+    image_info info;
+
+private:
+    enum EXPECT : uint8_t {
+        HEADER,     // RIFF, size, WEBP
+        CHUNK,      // FourCC and size
+        PAYLOAD,    // the start of the payload that is checked
+        SKIP        // the rest of the chunk
+    };
+
+    PARSE header();
+    PARSE next_chunk(uint64_t position);
+    PARSE chunk(uint64_t position);
+    PARSE image_chunk(uint64_t position);
+    PARSE check(uint64_t position, size_t n);
+    PARSE payload(uint64_t position);
+    PARSE skip_to(uint64_t position, uint64_t to);
+    PARSE boundary(uint64_t position);
+
+    EXPECT expect = HEADER;
+    uint32_t type = 0;
+    uint32_t length = 0;
+    uint64_t chunk_end = 0;     // with padding
+    uint64_t left = 0;
+    uint64_t end = 0;           // of the RIFF chunk
+    // VP8X
+    bool extended = false;
+    uint8_t flags = 0;
+    uint32_t canvas_width = 0;
+    uint32_t canvas_height = 0;
+    bool found_image = false;
+    bool found_anim = false;
+    bool lossless = false;
+    uint32_t frames = 0;
+    // the chunks of an image, ALPH followed by VP8 or a single VP8L
+    bool alpha = false;
+    bool in_frame = false;      // inside of ANMF
+    uint64_t frame_end = 0;     // of the ANMF payload
+    uint64_t frame_chunk_end = 0;
+    uint32_t image_width = 0;
+    uint32_t image_height = 0;
+    gather<16> head{ {}, 0, 12 };
+    uint64_t consumed = 0;
+};
 
 #endif
\ No newline at end of file
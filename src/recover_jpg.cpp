@@ -0,0 +1,128 @@
+#include "recover_jpg.h"
+#include "decode_jpg.h"
+#include "read_jpg.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    // break points tried before the place the decoder noticed the break
+    constexpr size_t MAX_BREAKS = 8;
+    // a continuation has to decode this far before it's decoded up to EOI
+    constexpr size_t MIN_TEST = 8192;
+
+    // the first marker in data that isn't stuffing or fill, 0 if there is none
+    uint8_t first_marker(std::span<const uint8_t> data) {
+        auto p = data.data();
+        const auto last = data.data() + data.size();
+        while ((p = static_cast<const uint8_t*>(std::memchr(p, 0xFF, last - p))) && last - p >= 2) {
+            if (p[1] != 0x00 && p[1] != 0xFF) {
+                return p[1];
+            }
+            ++p;
+        }
+        return 0;
+    }
+
+    // runs the decoder on head and on the disk from offset on, which is probed in steps that double from length up to limit
+    // MORE if the disk ends or can't be read before the stream does
+    jpg_decoder::result run_on_disk(const fragment_search& s, const jpg_decoder& decoder, jpg_decoder::state& state, std::span<const uint8_t> head, uint64_t offset, uint64_t length, uint64_t limit, std::deque<jpg_decoder::state>* checkpoints = nullptr, size_t keep = 0) {
+        const auto from = state;
+        if (!s.unreadable) {
+            length = limit;
+        }
+        while (true) {
+            const auto wanted = std::min(length, s.disk.size() - offset);
+            const auto readable = s.readable(offset, wanted);
+            state = from;
+            if (checkpoints) {
+                checkpoints->clear();
+            }
+            const auto result = decoder.run(state, { head, s.disk.subspan(offset, readable) }, checkpoints, keep);
+            if (result != jpg_decoder::MORE || readable < wanted || length >= limit || offset + wanted == s.disk.size()) {
+                return result;
+            }
+            length = std::min(2 * length, limit);
+        }
+    }
+
+    struct break_point {
+        uint64_t offset;
+        jpg_decoder::state resume; // the last MCU that started in front of it
+    };
+}
+
+std::optional<reassembled> recover_jpg(const fragment_search& s, uint64_t start) {
+    const auto disk = s.disk;
+    jpg_decoder decoder;
+    if (!decoder.open(disk.subspan(start))) {
+        return {};
+    }
+    const uint64_t data = start + decoder.data();
+    const auto cluster = cluster_at(s, start);
+    const auto phase = start % cluster;
+    const auto keep = std::max<size_t>(4 * cluster, MIN_TEST);
+
+    // decode in place up to where the scan breaks
+    std::deque<jpg_decoder::state> checkpoints;
+    auto broken = decoder.start();
+    if (run_on_disk(s, decoder, broken, {}, data, keep, disk.size(), &checkpoints, keep) != jpg_decoder::FAILED) {
+        return {};
+    }
+
+    // the break is on the cluster grid, after the last restart marker that was in order
+    // the decoder may have looked at 2 bytes behind it
+    std::vector<break_point> points;
+    const auto lowest = std::max(data + broken.marker, data + broken.pos - std::min<uint64_t>(broken.pos, keep));
+    for (auto b = (data + broken.pos + 2 - phase) / cluster * cluster + phase; b > lowest && points.size() < MAX_BREAKS; b -= cluster) {
+        const auto cp = std::find_if(checkpoints.rbegin(), checkpoints.rend(), [&](const jpg_decoder::state& c) { return data + c.pos <= b; });
+        if (cp != checkpoints.rend()) {
+            points.push_back({ b, *cp });
+        }
+        if (b < cluster) {
+            break;
+        }
+    }
+    if (points.empty()) {
+        return {};
+    }
+
+    const auto test = std::max<size_t>(2 * cluster, MIN_TEST);
+    candidates next(s, points.back().offset);
+    for (auto c = next.next(); c; c = next.next()) {
+        // the next restart marker of the continuation has to be the one that is due
+        const auto marker = decoder.restarts() ? first_marker(disk.subspan(*c, s.readable(*c, test))) : 0;
+        for (const auto& p : points) {
+            if (*c <= p.offset) {
+                continue;
+            }
+            if (marker >= 0xD0 && marker <= 0xD7 && marker != 0xD0 + p.resume.rst) {
+                continue;
+            }
+            const auto from = data + p.resume.pos;
+            auto state = p.resume;
+            state.pos = 0;
+            const auto head = disk.subspan(from, p.offset - from);
+            if (run_on_disk(s, decoder, state, head, *c, test, test) == jpg_decoder::FAILED) {
+                continue;
+            }
+
+            // decodes up to EOI from here
+            state = p.resume;
+            state.pos = 0;
+            if (run_on_disk(s, decoder, state, head, *c, 2 * test, disk.size()) != jpg_decoder::DONE) {
+                continue;
+            }
+            reassembled result;
+            result.fragments.push_back({ start, p.offset - start });
+            result.fragments.push_back({ *c, state.pos - head.size() });
+            for (const auto& f : result.fragments) {
+                result.data.insert(result.data.end(), disk.begin() + f.offset, disk.begin() + f.end());
+            }
+            if (read_jpg(result.data, &result.info).size() != result.data.size()) {
+                continue;
+            }
+            return result;
+        }
+    }
+    return {};
+}
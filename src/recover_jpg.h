@@ -0,0 +1,12 @@
+#ifndef H_RECOVER_JPG
+#define H_RECOVER_JPG
+
+#include <cstdint>
+#include <optional>
+#include "fragment.h"
+
+// reassembles a sequential jpg at start that was split in two at a cluster boundary
+// the decoder finds where the scan breaks, the continuation has to keep decoding (and the restart markers in order) up to EOI
+std::optional<reassembled> recover_jpg(const fragment_search& search, uint64_t start);
+
+#endif
@@ -0,0 +1,181 @@
+#include "recover_png.h"
+#include "read_png.h"
+#include "utils.h"
+#include <cctype>
+#define ZLIB_CONST
+#include <zlib.h>
+
+namespace {
+    // a file broken into more pieces than this is not worth the search
+    constexpr size_t MAX_FRAGMENTS = 4;
+    constexpr uint32_t MAX_LENGTH = 0x7FFFFFFF;
+    constexpr uint32_t IEND = 0x49454E44;
+    constexpr uint64_t SIGNATURE_SIZE = 8;
+
+    uint32_t be32(const uint8_t* p) {
+        return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+    }
+
+    bool valid_type(uint32_t type) {
+        for (int i = 0; i < 4; ++i) {
+            if (!std::isalpha(type >> (8 * i) & 0xFF)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // the file breaks at at and continues at to, next is the offset after the chunk that was repaired
+    struct jump {
+        uint64_t at;
+        uint64_t to;
+        uint64_t next;
+        uint32_t type;
+    };
+
+    // the header of the chunk at pos is intact, the break is somewhere in its type, data or crc
+    // the crc of every break point is kept, a candidate only hashes its own bytes once and combines
+    std::optional<jump> find_in_data(const fragment_search& s, uint64_t pos, uint32_t length, uint32_t type, uint32_t cluster, uint64_t phase) {
+        const auto disk = s.disk.data();
+        const uint64_t crc_at = pos + 8 + length;
+        const uint64_t end = crc_at + 4;
+
+        // break points on the cluster grid, with the crc of the chunk up to them
+        struct point {
+            uint64_t offset;
+            uLong crc;
+        };
+        std::vector<point> points;
+        uLong crc = crc32_z(0, nullptr, 0);
+        uint64_t hashed = pos + 4;
+        const auto readable = hashed + s.readable(hashed, end - hashed);
+        for (auto b = (pos + 8 - phase + cluster - 1) / cluster * cluster + phase; b < end && b < s.disk.size() && b <= readable; b += cluster) {
+            const auto to = std::min(b, crc_at);
+            crc = crc32_z(crc, disk + hashed, to - hashed);
+            hashed = to;
+            points.push_back({ b, crc });
+        }
+        if (points.empty()) {
+            return {};
+        }
+
+        candidates next(s, points.front().offset);
+        for (auto c = next.next(); c; c = next.next()) {
+            // the last break point leaves the shortest rest, the candidate is hashed front to back
+            uLong rest = crc32_z(0, nullptr, 0);
+            uint64_t done = 0;
+            for (auto p = points.rbegin(); p != points.rend(); ++p) {
+                if (*c <= p->offset) {
+                    continue;
+                }
+                const auto left = end - p->offset;
+                if (*c + left > s.disk.size() || s.readable(*c + done, left - done) < left - done) {
+                    break;
+                }
+                uint8_t stored[4];
+                uLong combined = p->crc;
+                if (p->offset >= crc_at) {
+                    // the crc itself is split
+                    const auto before = p->offset - crc_at;
+                    std::copy_n(disk + crc_at, before, stored);
+                    std::copy_n(disk + *c, 4 - before, stored + before);
+                } else {
+                    const auto data = left - 4;
+                    rest = crc32_z(rest, disk + *c + done, data - done);
+                    done = data;
+                    combined = crc32_combine(p->crc, rest, data);
+                    std::copy_n(disk + *c + data, 4, stored);
+                }
+                if (combined == be32(stored)) {
+                    return jump{ p->offset, *c, *c + left, type };
+                }
+            }
+        }
+        return {};
+    }
+
+    // the header of the chunk at pos is broken, so the break is at pos or inside the header
+    std::optional<jump> find_in_header(const fragment_search& s, uint64_t pos, uint32_t cluster, uint64_t phase) {
+        const auto disk = s.disk.data();
+        const auto b = pos < phase ? phase : (pos - phase + cluster - 1) / cluster * cluster + phase;
+        if (b >= pos + 8) {
+            return {};
+        }
+        const auto before = b - pos;
+
+        candidates next(s, b);
+        for (auto c = next.next(); c; c = next.next()) {
+            uint8_t header[8];
+            std::copy_n(disk + pos, before, header);
+            std::copy_n(disk + *c, 8 - before, header + before);
+            const auto length = be32(header);
+            const auto type = be32(header + 4);
+            const auto data = *c + 8 - before;
+            if (length > MAX_LENGTH || !valid_type(type) || data + length + 4 > s.disk.size() || s.readable(data, length + 4) < length + 4) {
+                continue;
+            }
+            auto crc = crc32_z(0, header + 4, 4);
+            crc = crc32_z(crc, disk + data, length);
+            if (crc == be32(disk + data + length)) {
+                return jump{ b, *c, data + length + 4, type };
+            }
+        }
+        return {};
+    }
+}
+
+std::optional<reassembled> recover_png(const fragment_search& s, uint64_t start) {
+    const auto disk = s.disk.data();
+    const auto cluster = cluster_at(s, start);
+    const auto phase = start % cluster;
+
+    reassembled result;
+    uint64_t piece = start;
+    uint64_t pos = start + SIGNATURE_SIZE;
+    while (true) {
+        if (s.expired() || pos + 12 > s.disk.size() || s.readable(pos, 8) < 8) {
+            return {};
+        }
+        const auto length = be32(disk + pos);
+        auto type = be32(disk + pos + 4);
+        const bool header = length <= MAX_LENGTH && valid_type(type);
+        const auto end = pos + 12 + length;
+        if (header && end <= s.disk.size() && s.readable(pos, end - pos) == end - pos && crc32_z(0, disk + pos + 4, 4 + length) == be32(disk + pos + 8 + length)) {
+            pos = end;
+        } else {
+            if (result.fragments.size() + 1 >= MAX_FRAGMENTS) {
+                return {};
+            }
+            std::optional<jump> j;
+            if (header) {
+                j = find_in_data(s, pos, length, type, cluster, phase);
+            }
+            if (!j) {
+                j = find_in_header(s, pos, cluster, phase);
+            }
+            if (!j) {
+                return {};
+            }
+            result.fragments.push_back({ piece, j->at - piece });
+            piece = j->to;
+            pos = j->next;
+            type = j->type;
+        }
+        if (type == IEND) {
+            break;
+        }
+    }
+    result.fragments.push_back({ piece, pos - piece });
+    if (result.fragments.size() == 1) {
+        // not fragmented, read_png turned it down for another reason
+        return {};
+    }
+
+    for (const auto& f : result.fragments) {
+        result.data.insert(result.data.end(), disk + f.offset, disk + f.end());
+    }
+    if (read_png(result.data, &result.info).size() != result.data.size() || !check_png_data(result.data)) {
+        return {};
+    }
+    return result;
+}
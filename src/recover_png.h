@@ -0,0 +1,12 @@
+#ifndef H_RECOVER_PNG
+#define H_RECOVER_PNG
+
+#include <cstdint>
+#include <optional>
+#include "fragment.h"
+
+// reassembles a png at start that broke at cluster boundaries, e.g. one read_png rejected for a bad chunk crc
+// the crc of the broken chunk decides which candidate continues it, the result has to pass check_png_data
+std::optional<reassembled> recover_png(const fragment_search& search, uint64_t start);
+
+#endif
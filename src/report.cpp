@@ -0,0 +1,153 @@
+#include "report.h"
+#include <chrono>
+#include <condition_variable>
+#include <format>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <unistd.h>
+
+progress counters;
+
+namespace {
+    constexpr auto REFRESH = std::chrono::milliseconds(250);
+
+    const bool atty_stderr = isatty(fileno(stderr));
+    const bool atty_stdout = isatty(fileno(stdout));
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::string pending_lines;
+    bool stopping = false;
+    std::thread thread;
+
+    // throughput, smoothed over a few refreshes
+    double bytes_rate = 0;
+    double candidates_rate = 0;
+    uint64_t last_offset = 0;
+    uint64_t last_candidates = 0;
+    auto last_time = std::chrono::steady_clock::now();
+
+    std::string format_duration(double seconds) {
+        const auto s = uint64_t(seconds);
+        return std::format("{:02d}:{:02d}:{:02d}", s / 3600, (s / 60) % 60, s % 60);
+    }
+
+    std::string progress_line() {
+        const auto offset = counters.offset.load(std::memory_order_relaxed);
+        const auto candidates = counters.candidates.load(std::memory_order_relaxed);
+
+        const auto now = std::chrono::steady_clock::now();
+        const std::chrono::duration<double> elapsed = now - last_time;
+        if (elapsed.count() > 0) {
+            const auto b = (offset - last_offset) / elapsed.count();
+            const auto c = (candidates - last_candidates) / elapsed.count();
+            bytes_rate = bytes_rate ? 0.7 * bytes_rate + 0.3 * b : b;
+            candidates_rate = candidates_rate ? 0.7 * candidates_rate + 0.3 * c : c;
+        }
+        last_time = now;
+        last_offset = offset;
+        last_candidates = candidates;
+
+        const auto percent = counters.total ? offset / double(counters.total) * 100 : 100;
+        const auto eta = bytes_rate > 0 ? format_duration((counters.total - offset) / bytes_rate) : std::string("--:--:--");
+        // autowrap is off while it is written, a line wider than the terminal is cut instead of leaving a row behind on each redraw
+        auto line = std::format(
+            "\33[?7l\33[2K\r\33[1m{:6.2f}\33[0m% {}/{} {}/s {:9.0f} cand/s ETA {} \33[1m{:11d}\33[0m images",
+            percent,
+            format_bytes(offset, true),
+            format_bytes(counters.total, true),
+            format_bytes(bytes_rate, true),
+            candidates_rate,
+            eta,
+            counters.found.load(std::memory_order_relaxed)
+        );
+        // only the formats found so far
+        for (int f = 0; f < FORMAT_COUNT; ++f) {
+            const auto found = counters.found_format[f].load(std::memory_order_relaxed);
+            if (found) {
+                line += std::format(" {} {}", FORMAT_NAMES[f], found);
+            }
+        }
+        return line + "\33[?7h";
+    }
+
+    void flush(bool redraw) {
+        std::string lines;
+        {
+            std::lock_guard lock(mutex);
+            lines.swap(pending_lines);
+        }
+        if (!lines.empty()) {
+            if (atty_stderr && atty_stdout) {
+                fprintf(stderr, "\33[2K\r");
+                fflush(stderr);
+            }
+            fwrite(lines.data(), 1, lines.size(), stdout);
+            fflush(stdout);
+        }
+        if (redraw && atty_stderr) {
+            const auto line = progress_line();
+            fwrite(line.data(), 1, line.size(), stderr);
+            fflush(stderr);
+        }
+    }
+
+    void run() {
+        std::unique_lock lock(mutex);
+        while (!stopping) {
+            cv.wait_for(lock, REFRESH, [] { return stopping; });
+            lock.unlock();
+            flush(true);
+            lock.lock();
+        }
+    }
+}
+
+std::string format_bytes(size_t size, bool atty) {
+    double v = size;
+    const char* u = nullptr;
+    if (v < 1024 * 1024) {
+        v /= 1024;
+        u = "KiB";
+    } else if (v < 1024 * 1024 * 1024) {
+        v /= 1024 * 1024;
+        u = "MiB";
+    } else {
+        v /= 1024 * 1024 * 1024;
+        u = "GiB";
+    }
+    if (atty) {
+        return std::format("\33[1m{:7.2f}\33[0m{}", v, u);
+    }
+    return std::format("{:.2f}{}", v, u);
+}
+
+void report_start(uint64_t total) {
+    counters.total = total;
+    thread = std::thread(run);
+}
+
+void report_image(const std::string& name, size_t size) {
+    std::string line;
+    if (atty_stdout) {
+        line = std::format("{:34} {}\n", name, format_bytes(size, true));
+    } else {
+        line = name + "\n";
+    }
+    std::lock_guard lock(mutex);
+    pending_lines += line;
+}
+
+void report_stop() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    thread.join();
+    flush(true);
+    if (atty_stderr) {
+        fprintf(stderr, "\n");
+    }
+}
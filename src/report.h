@@ -0,0 +1,30 @@
+#ifndef H_REPORT
+#define H_REPORT
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "image_info.h"
+
+// written by the scan, read by the reporter thread
+struct progress {
+    std::atomic<uint64_t> offset = 0;
+    std::atomic<uint64_t> candidates = 0;
+    std::atomic<uint64_t> found = 0;
+    std::atomic<uint64_t> found_format[FORMAT_COUNT] = {};
+    uint64_t total = 0;
+};
+
+extern progress counters;
+
+std::string format_bytes(size_t size, bool atty);
+
+// redraws the progress line at a fixed rate and flushes the log lines in batches
+void report_start(uint64_t total);
+// queues a line for stdout, never blocks on the terminal
+void report_image(const std::string& name, size_t size);
+// stops the thread, flushes everything and prints the final progress
+void report_stop();
+
+#endif
@@ -0,0 +1,55 @@
+#include "schedule.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+namespace {
+    // /sys/dev/block/<major>:<minor> links to the device, a partition is a subdirectory of its disk
+    dev_t whole_disk(dev_t dev) {
+        const auto link = "/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+        char resolved[PATH_MAX];
+        if (!realpath(link.c_str(), resolved)) {
+            // not a block device, e.g. tmpfs or a btrfs subvolume
+            return dev;
+        }
+        std::string path = resolved;
+        if (access((path + "/partition").c_str(), F_OK) != 0) {
+            return dev;
+        }
+        path = path.substr(0, path.rfind('/'));
+        auto file = fopen((path + "/dev").c_str(), "r");
+        if (!file) {
+            return dev;
+        }
+        unsigned dev_major = 0;
+        unsigned dev_minor = 0;
+        const bool ok = fscanf(file, "%u:%u", &dev_major, &dev_minor) == 2;
+        fclose(file);
+        return ok ? makedev(dev_major, dev_minor) : dev;
+    }
+}
+
+dev_t backing_device(const struct stat& sb) {
+    return whole_disk(S_ISBLK(sb.st_mode) ? sb.st_rdev : sb.st_dev);
+}
+
+std::vector<std::vector<size_t>> group_by_device(const std::vector<struct stat>& inputs) {
+    std::vector<dev_t> devices;
+    std::vector<std::vector<size_t>> groups;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        const auto dev = backing_device(inputs[i]);
+        size_t g = 0;
+        while (g < devices.size() && devices[g] != dev) {
+            ++g;
+        }
+        if (g == devices.size()) {
+            devices.push_back(dev);
+            groups.emplace_back();
+        }
+        groups[g].push_back(i);
+    }
+    return groups;
+}
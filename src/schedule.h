@@ -0,0 +1,15 @@
+#ifndef H_SCHEDULE
+#define H_SCHEDULE
+
+#include <cstddef>
+#include <sys/stat.h>
+#include <vector>
+
+// the disk a file or block device is stored on, partitions map to their disk
+dev_t backing_device(const struct stat& sb);
+
+// groups the inputs by backing device, in order of their first appearance
+// returns the indices of the inputs for each device
+std::vector<std::vector<size_t>> group_by_device(const std::vector<struct stat>& inputs);
+
+#endif
@@ -0,0 +1,104 @@
+#include "unreadable.h"
+#include <atomic>
+#include <cerrno>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22 // linux 5.14
+#endif
+
+unreadable_map::unreadable_map(int fd, std::span<const uint8_t> disk) : fd(fd), disk(disk), pagesize(getpagesize()) {}
+
+bool unreadable_map::probe(uint64_t offset, size_t length) {
+    static std::atomic<bool> populate_read = true;
+    if (populate_read) {
+        if (madvise((void*)(disk.data() + offset), length, MADV_POPULATE_READ) == 0) {
+            return true;
+        }
+        if (errno != EINVAL) {
+            return false;
+        }
+        // kernel too old
+        populate_read = false;
+    }
+    // reads the pages into the page cache, the mapping is served from there
+    static thread_local std::vector<uint8_t> buffer;
+    buffer.resize(length);
+    return pread(fd, buffer.data(), length, offset) == ssize_t(length);
+}
+
+void unreadable_map::record(uint64_t offset, uint64_t end) {
+    std::lock_guard lock(mutex);
+    auto it = holes.upper_bound(offset);
+    if (it != holes.begin() && std::prev(it)->second >= offset) {
+        --it;
+        offset = it->first;
+    }
+    // joins the holes it touches
+    while (it != holes.end() && it->first <= end) {
+        end = std::max(end, it->second);
+        it = holes.erase(it);
+    }
+    holes.emplace(offset, end);
+}
+
+uint64_t unreadable_map::first(uint64_t offset, uint64_t end) {
+    std::lock_guard lock(mutex);
+    auto it = holes.upper_bound(offset);
+    if (it != holes.begin() && std::prev(it)->second > offset) {
+        return offset;
+    }
+    return it != holes.end() && it->first < end ? it->first : end;
+}
+
+size_t unreadable_map::readable(std::span<const uint8_t> data) {
+    if (data.empty()) {
+        return 0;
+    }
+    const uint64_t offset = data.data() - disk.data();
+    const uint64_t end = offset + data.size();
+    // a recorded hole isn't read again, failing pages can take seconds each
+    const uint64_t to = first(offset / pagesize * pagesize, end);
+    auto page = offset / pagesize * pagesize;
+    if (to > page && probe(page, to - page)) {
+        page = to;
+    } else {
+        // page by page up to the one that fails, the ones in front are resident already
+        while (page < to && probe(page, std::min<uint64_t>(pagesize, disk.size() - page))) {
+            page += pagesize;
+        }
+        if (page < to) {
+            record(page, std::min<uint64_t>(page + pagesize, disk.size()));
+        }
+    }
+    return std::min(page, end) > offset ? std::min(page, end) - offset : 0;
+}
+
+uint64_t unreadable_map::skip(uint64_t offset, uint64_t limit) {
+    auto page = offset / pagesize * pagesize;
+    while (page < limit) {
+        std::unique_lock lock(mutex);
+        auto it = holes.upper_bound(page);
+        if (it != holes.begin() && std::prev(it)->second > page) {
+            page = std::prev(it)->second;
+            continue;
+        }
+        lock.unlock();
+        if (probe(page, std::min<uint64_t>(pagesize, disk.size() - page))) {
+            break;
+        }
+        record(page, std::min<uint64_t>(page + pagesize, disk.size()));
+        page += pagesize;
+    }
+    return std::max(offset, std::min(page, limit));
+}
+
+std::vector<range> unreadable_map::ranges() {
+    std::lock_guard lock(mutex);
+    std::vector<range> result;
+    for (const auto& [offset, end] : holes) {
+        result.push_back({ offset, end - offset });
+    }
+    return result;
+}
@@ -0,0 +1,40 @@
+#ifndef H_UNREADABLE
+#define H_UNREADABLE
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <span>
+#include <vector>
+#include "range.h"
+
+// the pages of a memory mapped disk image that can't be read (bad sectors, a file truncated during the scan, a lost network share)
+// touching one raises SIGBUS, so everything is probed with MADV_POPULATE_READ before it is read
+// probed pages are resident, reading them right after doesn't fault
+class unreadable_map {
+public:
+    unreadable_map(int fd, std::span<const uint8_t> disk);
+
+    // thread safe, length of the part at the front of data that can be read, the page after it is recorded
+    size_t readable(std::span<const uint8_t> data);
+    // thread safe, the first readable offset from offset on, limit if there is none before it
+    // the pages in between are recorded
+    uint64_t skip(uint64_t offset, uint64_t limit);
+    // what was recorded, sorted and merged
+    std::vector<range> ranges();
+
+private:
+    bool probe(uint64_t offset, size_t length);
+    void record(uint64_t offset, uint64_t end);
+    // start of the recorded hole that reaches into [offset, end), end if there is none
+    uint64_t first(uint64_t offset, uint64_t end);
+
+    const int fd;
+    const std::span<const uint8_t> disk;
+    const size_t pagesize;
+    std::mutex mutex;
+    std::map<uint64_t, uint64_t> holes; // start to end, page aligned and disjoint
+};
+
+#endif
@@ -2,10 +2,28 @@
 #define H_UTILS
 
 #include <bit>
+#include <cstdint>
 #include <cstring>
 #include <span>
 #include <type_traits>
 
+#ifdef FUZZ
+// what the parsers looked at, the fuzzers check that it grows linear with the input
+struct fuzz_cost {
+    uint64_t bytes = 0;
+    uint64_t steps = 0;
+};
+inline thread_local fuzz_cost fuzz_counted;
+#endif
+
+// counts for the fuzzers what a parser looked at, does nothing in the tool itself
+inline void fuzz_count(uint64_t bytes, uint64_t steps = 1) {
+#ifdef FUZZ
+    fuzz_counted.bytes += bytes;
+    fuzz_counted.steps += steps;
+#endif
+}
+
 template<typename T> std::span<T> subspan(const std::span<T> span, std::size_t offset, std::size_t count = std::dynamic_extent) {
     const auto n_offset_start = std::min(offset, span.size());
     const auto n_offset_end   = std::max(n_offset_start, std::min(offset + count, span.size()));
@@ -24,6 +42,7 @@ template<typename T, std::endian source, std::endian target = std::endian::nativ
 
 template<typename T, std::endian endian = std::endian::native> T peek(std::span<const uint8_t> data, size_t offset = 0) {
     data = subspan(data, offset);
+    fuzz_count(std::min(sizeof(T), data.size()));
     if (data.size() < sizeof(T)) [[unlikely]] {
         return T{};
     }
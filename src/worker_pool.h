@@ -0,0 +1,94 @@
+#ifndef H_WORKER_POOL
+#define H_WORKER_POOL
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// fixed number of threads working on a shared fifo
+// used for expensive checks, so the scanner thread doesn't have to wait on them
+class worker_pool {
+public:
+    explicit worker_pool(unsigned count = std::thread::hardware_concurrency()) {
+        count = std::max(count, 1u);
+        for (unsigned i = 0; i < count; ++i) {
+            threads.emplace_back([this] { run(); });
+        }
+    }
+
+    ~worker_pool() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+
+    size_t size() const {
+        return threads.size();
+    }
+
+    // runs the oldest queued task on the calling thread, false if there is none
+    // a thread waiting on a result helps instead of blocking
+    bool help() {
+        std::function<void()> task;
+        {
+            std::lock_guard lock(mutex);
+            if (tasks.empty()) {
+                return false;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+        return true;
+    }
+
+    template<typename F> auto submit(F&& f) -> std::future<decltype(f())> {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+        auto result = task->get_future();
+        {
+            std::lock_guard lock(mutex);
+            tasks.emplace_back([task] { (*task)(); });
+        }
+        cv.notify_one();
+        return result;
+    }
+
+private:
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock(mutex);
+                cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
+
+#endif